@@ -40,6 +40,9 @@ vector<string> split(const string& str, const string& delim) {
 		p = strtok(NULL, d);
 	}
 
+	delete[] strs;
+	delete[] d;
+
 	return res;
 }
 
@@ -1,4 +1,3 @@
-
 #define FILE_EXTENSION ".txt"
 #include<fstream>
 #include<string>
@@ -6,9 +5,46 @@
 #include <utility>
 #include<vector>
 #include<iostream>
-#include <filesystem>
-#include <regex>
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <memory>
 #include <set>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <climits>
+#include <cmath>
+#include <queue>
+#include <string_view>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <poll.h>
+#endif
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#endif
 
 using namespace std;
 
@@ -16,451 +52,5489 @@ const int EXACT = 0;
 const int PREFIX = 1;
 const int SUFFIX = 2;
 const int INFIX = 3;
+const int PHRASE = 4; // "several words", adjacent and in order
+const int NEAR = 5;   // a NEAR/k b, within k words of each other
+const int FUZZY = 6;  // word~k, any word within k edits
+const int SUBSTRING = 7; // {part}, any word containing part
+
+const int MAX_FUZZY_EDITS = 3;
 
 const char OP_AND = '+';
 const char OP_OR = '/';
 const char OP_EXCLUDE = '-';
 
-int extract_word(string &word) {
-    if (word[0] == '"') {
-        word.erase(std::remove(word.begin(), word.end(), '\"'), word.end());
-        return EXACT;;
+/**
+ * Read-only view of a whole file: mapped on POSIX systems, read into a
+ * buffer elsewhere.
+ */
+class MappedFile {
+    const char *bytes = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    bool opened = false;
+    vector<char> buffer;
+
+public:
+    explicit MappedFile(const string &path) {
+#if defined(__unix__) || defined(__APPLE__)
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st{};
+        if (fstat(fd, &st) == 0) {
+            opened = true;
+            length = st.st_size;
+            if (length > 0) {
+                void *view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (view != MAP_FAILED) {
+                    bytes = static_cast<const char *>(view);
+                    mapped = true;
+                } else {
+                    opened = false;
+                    length = 0;
+                }
+            }
+        }
+        close(fd);
+#else
+        ifstream fi(path, ios::in | ios::binary);
+        if (!fi.is_open()) {
+            return;
+        }
+        opened = true;
+        buffer.assign(istreambuf_iterator<char>(fi), istreambuf_iterator<char>());
+        bytes = buffer.data();
+        length = buffer.size();
+#endif
     }
-    if (word[0] == '*' || word[word.length() - 1] == '*') {
-        word.erase(std::remove(word.begin(), word.end(), '*'), word.end());
-        return SUFFIX;;
+
+    ~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (mapped) {
+            munmap(const_cast<char *>(bytes), length);
+        }
+#endif
     }
-    if (word['<']) {
-        word.erase(1, word.length() - 2);
-        return INFIX;
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool is_open() const {
+        return opened;
     }
-    return PREFIX;
-}
 
+    const char *data() const {
+        return bytes;
+    }
+
+    size_t size() const {
+        return length;
+    }
+};
+
+/**
+ * Trie node stored in an arena. Children are addressed by 32-bit arena
+ * indices packed in letter order at edges[first, first + popcount(mask)),
+ * so a node costs 12 bytes plus 4 per child instead of 26 pointers.
+ */
 struct Node {
-    Node *child[26];
+    uint32_t mask = 0;  // bit c set when the node has a child for 'a' + c
+    uint32_t first = 0; // first child slot in the edge arena
+    int32_t term = -1;  // dictionary term id of the word ending here
+};
+
+// layout the trie used before the arena, kept for the memory report
+struct PointerNode {
+    PointerNode *child[26];
     char ch;
     bool isEndOfWord;
 };
 
 /**
- * Tri
+ * Trie over lowercase words, used while building to give each distinct
+ * word a term id: terminal nodes carry the id the word was registered
+ * under. freeze() turns the vocabulary into a Dawg for lookups.
  */
 class TrieTree {
-    Node *root;
+    vector<Node> nodes;
+    vector<uint32_t> edges;
 
 public:
     TrieTree() {
-        root = new Node();
+        nodes.emplace_back();
     }
 
-    ~TrieTree() {
-        delete root;
+    uint32_t insert(string_view word) {
+        uint32_t current = 0;
+        for (const char ch: word) {
+            current = child_or_insert(current, tolower(ch) - 'a');
+        }
+        return current;
     }
 
-    void insert(const string &word) const {
-        Node *current = root;
-        const int len = word.length();
-        for (int i = 0; i < len; i++) {
-            const int c = tolower(word[i]);
-            if (current->child[c - 'a'] == NULL) {
-                Node *newNode = new Node();
-                newNode->ch = c;
-                newNode->isEndOfWord = i == len - 1 ? true : false;
-                current->child[c - 'a'] = newNode;
-                current = newNode;
-            } else {
-                current = current->child[c - 'a'];
+    int32_t term(const uint32_t node) const {
+        return nodes[node].term;
+    }
+
+    void set_term(const uint32_t node, const int32_t term) {
+        nodes[node].term = term;
+    }
+
+private:
+    uint32_t child_or_insert(const uint32_t node, const int c) {
+        const uint32_t count = __builtin_popcount(nodes[node].mask);
+        const uint32_t rank = __builtin_popcount(nodes[node].mask & ((1u << c) - 1));
+        if (nodes[node].mask >> c & 1u) {
+            return edges[nodes[node].first + rank];
+        }
+        const uint32_t created = nodes.size();
+        nodes.emplace_back();
+        // the child list grows by one: extend it in place when it is the
+        // last slot in the arena, otherwise move it to the end
+        Node &n = nodes[node];
+        if (n.first + count != edges.size()) {
+            const uint32_t moved = edges.size();
+            for (uint32_t e = 0; e < count; e++) {
+                const uint32_t slot = edges[n.first + e];
+                edges.emplace_back(slot);
             }
+            n.first = moved;
         }
+        edges.emplace_back();
+        for (uint32_t e = n.first + count; e > n.first + rank; e--) {
+            edges[e] = edges[e - 1];
+        }
+        edges[n.first + rank] = created;
+        n.mask |= 1u << c;
+        return created;
     }
+};
 
-    void insert_reverse(const string &word) const {
-        Node *current = root;
-        const int index = word.length() - 1;
-        for (int i = index; i >= 0; i--) {
-            const int c = tolower(word[i]);
-            if (current->child[c - 'a'] == nullptr) {
-                Node *newNode = new Node();
-                newNode->ch = c;
-                newNode->isEndOfWord = i == 0 ? true : false;
-                current->child[c - 'a'] = newNode;
-                current = newNode;
-            } else {
-                current = current->child[c - 'a'];
+/**
+ * State of the dictionary automaton, stored in an arena the way trie nodes
+ * are: outgoing edges in letter order at edges[first, first + letter count).
+ */
+struct DawgState {
+    uint32_t mask = 0;  // bit c set for an edge on 'a' + c, FINAL_STATE when a word ends here
+    uint32_t first = 0; // first edge slot in the edge arena
+    uint32_t words = 0; // words accepted from this state, one ending here included
+};
+
+const uint32_t LETTER_BITS = (1u << 26) - 1;
+const uint32_t FINAL_STATE = 1u << 31;
+
+/**
+ * The dictionary as a minimal acyclic automaton (DAWG). Words with a
+ * common prefix share the path that spells it, as in a trie, and words
+ * with a common tail also share the states that spell the tail, which a
+ * trie cannot do. Term ids are the words' ranks in sorted order, so they
+ * are never stored: a word's id is the count of words sorting before it,
+ * summed from the words counts of the states it passes, and the words
+ * under a prefix form one contiguous run of ids.
+ */
+class Dawg {
+    const DawgState *state_at = nullptr;
+    const uint32_t *edge_at = nullptr;
+    size_t state_total = 0;
+    size_t edge_total = 0;
+
+public:
+    /**
+     * Minimal automaton over words, which must be sorted and distinct.
+     * Words go in one at a time (Daciuk et al.): what the previous word
+     * does not share with the next can no longer change, so those states
+     * are merged into an equal state already registered, or registered
+     * themselves, deepest first. State 0 is the start state.
+     */
+    static void build(const vector<string> &words, vector<DawgState> &states, vector<uint32_t> &edges) {
+        struct Draft {
+            bool final = false;
+            vector<pair<char, uint32_t>> edges;
+        };
+        vector<Draft> drafts(1);
+        unordered_map<string, uint32_t> registry;
+        vector<uint32_t> path = {0}; // unregistered states along the last word, path[i] after i letters
+        auto minimize = [&](const size_t depth) {
+            while (path.size() > depth + 1) {
+                const uint32_t state = path.back();
+                path.pop_back();
+                string key(1, drafts[state].final ? '1' : '0');
+                for (auto &edge: drafts[state].edges) {
+                    key += edge.first;
+                    key.append((const char *) &edge.second, sizeof(edge.second));
+                }
+                const auto found = registry.emplace(std::move(key), state);
+                if (!found.second) {
+                    drafts[path.back()].edges.back().second = found.first->second;
+                    vector<pair<char, uint32_t>>().swap(drafts[state].edges);
+                }
+            }
+        };
+        string_view previous;
+        for (auto &word: words) {
+            size_t common = 0;
+            while (common < word.size() && common < previous.size() && word[common] == previous[common]) {
+                common++;
+            }
+            minimize(common);
+            for (size_t i = common; i < word.size(); i++) {
+                drafts[path.back()].edges.emplace_back(word[i], drafts.size());
+                path.emplace_back(drafts.size());
+                drafts.emplace_back();
             }
+            drafts[path.back()].final = true;
+            previous = word;
         }
+        minimize(0);
+
+        // number the reachable states breadth-first from the start state, which so
+        // becomes state 0, laying out each state's edges as it is numbered
+        vector<uint32_t> number(drafts.size(), UINT32_MAX);
+        vector<uint32_t> order = {0};
+        number[0] = 0;
+        states.clear();
+        edges.clear();
+        for (size_t i = 0; i < order.size(); i++) {
+            DawgState state;
+            state.mask = drafts[order[i]].final ? FINAL_STATE : 0;
+            state.first = edges.size();
+            for (auto &edge: drafts[order[i]].edges) {
+                state.mask |= 1u << (edge.first - 'a');
+                if (number[edge.second] == UINT32_MAX) {
+                    number[edge.second] = order.size();
+                    order.emplace_back(edge.second);
+                }
+                edges.emplace_back(number[edge.second]);
+            }
+            states.emplace_back(state);
+        }
+        count_words(states, edges, 0);
+    }
+
+    // serve lookups from arrays owned elsewhere, such as a mapped index file
+    void attach(const DawgState *state_data, const size_t state_count,
+                const uint32_t *edge_data, const size_t edge_count) {
+        state_at = state_data;
+        edge_at = edge_data;
+        state_total = state_count;
+        edge_total = edge_count;
+    }
+
+    // term id of word, -1 when it is not in the dictionary
+    int find(string_view word) const {
+        uint32_t state = 0;
+        int rank = 0;
+        if (!walk(word, state, rank)) {
+            return -1;
+        }
+        return state_at[state].mask & FINAL_STATE && (uint32_t) rank < word_total() ? rank : -1;
+    }
+
+    // the run of term ids starting with prefix: [first, first + count)
+    bool prefix_range(string_view prefix, int &first, int &count) const {
+        uint32_t state = 0;
+        first = 0;
+        if (!walk(prefix, state, first)) {
+            return false;
+        }
+        count = state_at[state].words;
+        return (uint32_t) first <= word_total() && (uint32_t) count <= word_total() - first;
+    }
+
+    /**
+     * Term ids of every word within max_edits insertions, deletions or
+     * substitutions of word, ascending, found in one walk. Each state
+     * carries the row of the edit distance table for the path leading to
+     * it, which is the state of a Levenshtein automaton for word; a branch
+     * is abandoned as soon as every entry of its row exceeds max_edits,
+     * since a longer path can only cost more.
+     */
+    void collect_within(const string &word, const int max_edits, vector<int> &terms) const {
+        vector<int> row(word.size() + 1);
+        for (size_t i = 0; i < row.size(); i++) {
+            row[i] = i;
+        }
+        collect_within(0, 0, word, max_edits, row, terms);
+    }
+
+    size_t state_count() const {
+        return state_total;
+    }
+
+    size_t edge_count() const {
+        return edge_total;
+    }
+
+    size_t bytes() const {
+        return state_total * sizeof(DawgState) + edge_total * sizeof(uint32_t);
+    }
+
+private:
+    // words in the whole dictionary, so one past the largest term id
+    uint32_t word_total() const {
+        return state_total == 0 ? 0 : state_at[0].words;
     }
 
-    bool search(string &word, bool exact_match) const {
-        Node *current = root;
-        int matchCount = 0;
-        int len = word.length();
-        for (int i = 0; i < len; i++) {
-            const int c = tolower(word[i]);
-            current = current->child[c - 'a'];
-            if (current == nullptr) {
+    // whether the edges of s and the states they lead to lie inside the arrays;
+    // a damaged index file can hold anything, and lookups must not read past it
+    bool edges_in_range(const DawgState &s, const uint32_t end) const {
+        if ((uint64_t) s.first + __builtin_popcount(s.mask & LETTER_BITS) > edge_total) {
+            return false;
+        }
+        for (uint32_t e = s.first; e < end; e++) {
+            if (edge_at[e] >= state_total) {
                 return false;
             }
-            matchCount++;
         }
-        if (exact_match && current->isEndOfWord) {
-            return true;
-        }
-        return matchCount == len;
+        return true;
     }
-};
 
-class Essay {
-public:
-    string name;
-    TrieTree *prefix;
-    TrieTree *suffix;
+    static uint32_t count_words(vector<DawgState> &states, const vector<uint32_t> &edges, const uint32_t state) {
+        DawgState &s = states[state];
+        if (s.words == 0) {
+            uint32_t words = s.mask & FINAL_STATE ? 1 : 0;
+            const uint32_t end = s.first + __builtin_popcount(s.mask & LETTER_BITS);
+            for (uint32_t e = s.first; e < end; e++) {
+                words += count_words(states, edges, edges[e]);
+            }
+            states[state].words = words;
+        }
+        return states[state].words;
+    }
 
-    Essay(string name, TrieTree *prefix, TrieTree *suffix): name(std::move(name)), prefix(prefix), suffix(suffix) {
+    // follow word from the start state, adding up the words that sort before it
+    bool walk(string_view word, uint32_t &state, int &rank) const {
+        for (const char ch: word) {
+            const int c = tolower(ch) - 'a';
+            const DawgState &s = state_at[state];
+            if (c < 0 || c >= 26 || !(s.mask >> c & 1u)) {
+                return false;
+            }
+            rank += s.mask & FINAL_STATE ? 1 : 0;
+            const uint32_t at = s.first + __builtin_popcount(s.mask & ((1u << c) - 1));
+            if (!edges_in_range(s, at + 1)) {
+                return false;
+            }
+            for (uint32_t e = s.first; e < at; e++) {
+                rank += state_at[edge_at[e]].words;
+            }
+            state = edge_at[at];
+        }
+        return true;
     }
 
-    ~Essay() {
-        delete prefix;
-        delete suffix;
+    void collect_within(const uint32_t state, int rank, const string &word, const int max_edits,
+                        const vector<int> &row, vector<int> &terms) const {
+        const DawgState &s = state_at[state];
+        if (!edges_in_range(s, s.first + __builtin_popcount(s.mask & LETTER_BITS))) {
+            return;
+        }
+        if (s.mask & FINAL_STATE) {
+            if (row.back() <= max_edits && (uint32_t) rank < word_total()) {
+                terms.emplace_back(rank);
+            }
+            rank++;
+        }
+        vector<int> next(row.size());
+        uint32_t e = s.first;
+        for (uint32_t rest = s.mask & LETTER_BITS; rest != 0; rest &= rest - 1, e++) {
+            const char ch = 'a' + __builtin_ctz(rest);
+            next[0] = row[0] + 1;
+            int best = next[0];
+            for (size_t i = 1; i < row.size(); i++) {
+                next[i] = std::min({row[i] + 1, next[i - 1] + 1, row[i - 1] + (word[i - 1] != ch)});
+                best = std::min(best, next[i]);
+            }
+            if (best <= max_edits) {
+                collect_within(edge_at[e], rank, word, max_edits, next, terms);
+            }
+            rank += state_at[edge_at[e]].words;
+        }
     }
 };
 
+/**
+ * Posting list encoding. Doc ids are stored as gaps (doc - previous - 1):
+ *
+ *   varint count
+ *   when count > POSTING_BLOCK, a skip table with one 8-byte entry per
+ *   block: uint32 last doc id of the block, uint32 block offset from the
+ *   end of the table
+ *   full blocks of POSTING_BLOCK gaps: one byte bit width, then the gaps
+ *   bit-packed at that width
+ *   the remaining gaps as varints
+ *
+ * Short lists, the vast majority of the vocabulary, are plain varints.
+ */
+const int POSTING_BLOCK = 128;
 
-// Utility Func
+void put_varint(string &out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back((char) (value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char) value);
+}
 
-// string parser : output vector of strings (words) after parsing
-vector<string> word_parse(vector<string> tmp_string) {
-    vector<string> parse_string;
-    for (auto &word: tmp_string) {
-        string new_str;
-        for (auto &ch: word) {
-            if (isalpha(ch))
-                new_str.push_back(ch);
+// read a varint at in, false rather than read at or past end
+bool get_varint(const uint8_t *&in, const uint8_t *end, uint32_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 35 && in < end; shift += 7) {
+        const uint8_t byte = *in++;
+        value |= (uint32_t) (byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            return true;
         }
-        parse_string.emplace_back(new_str);
     }
-    return parse_string;
+    return false;
 }
 
-vector<string> split(const string &str, const string &delim) {
-    vector<string> res;
-    if ("" == str) return res;
+/**
+ * Encodes a posting list one doc id at a time, so that a list never has to
+ * be held whole. start() writes the count and a zeroed skip table, add()
+ * writes each block as soon as it is complete, and skip_table() holds the
+ * entries to write over the zeroed table once the list is done.
+ */
+class PostingEncoder {
+public:
+    void start(const int count, string &out) {
+        total = count;
+        added = 0;
+        previous = -1;
+        written = 0;
+        put_varint(out, count);
+        const int blocks = count > POSTING_BLOCK ? (count + POSTING_BLOCK - 1) / POSTING_BLOCK : 0;
+        table.assign(blocks * 2, 0);
+        out.append(blocks * 8, '\0');
+    }
 
-    char *strs = new char[str.length() + 1];
-    strcpy(strs, str.c_str());
+    void add(const int doc, string &out) {
+        const size_t before = out.size();
+        const int block = added / POSTING_BLOCK;
+        const int i = added % POSTING_BLOCK;
+        if (!table.empty()) {
+            if (i == 0) {
+                table[block * 2 + 1] = written;
+            }
+            table[block * 2] = doc;
+        }
+        if (total - block * POSTING_BLOCK < POSTING_BLOCK) {
+            // the short last block stays varints
+            put_varint(out, doc - previous - 1);
+        } else {
+            gaps[i] = doc - previous - 1;
+            if (i == POSTING_BLOCK - 1) {
+                pack(out);
+            }
+        }
+        previous = doc;
+        added++;
+        written += out.size() - before;
+    }
 
-    char *d = new char[delim.length() + 1];
-    strcpy(d, delim.c_str());
+    // last doc id and data offset per block, empty for short lists
+    const vector<uint32_t> &skip_table() const {
+        return table;
+    }
 
-    char *p = strtok(strs, d);
-    while (p) {
-        string s = p;
-        res.push_back(s);
-        p = strtok(NULL, d);
+private:
+    int total = 0;
+    int added = 0;
+    int previous = -1;
+    uint32_t written = 0;
+    vector<uint32_t> table;
+    uint32_t gaps[POSTING_BLOCK];
+
+    void pack(string &out) const {
+        uint32_t widest = 0;
+        for (const uint32_t gap: gaps) {
+            widest |= gap;
+        }
+        const int bits = widest == 0 ? 0 : 32 - __builtin_clz(widest);
+        out.push_back((char) bits);
+        uint64_t buffer = 0;
+        int filled = 0;
+        for (const uint32_t gap: gaps) {
+            buffer |= (uint64_t) gap << filled;
+            filled += bits;
+            while (filled >= 8) {
+                out.push_back((char) buffer);
+                buffer >>= 8;
+                filled -= 8;
+            }
+        }
+        if (filled > 0) {
+            out.push_back((char) buffer);
+        }
     }
+};
 
-    return res;
-}
+/**
+ * Forward cursor over an encoded posting list. Only the block holding the
+ * current doc is decoded, and advance() uses the skip table to step over
+ * whole blocks without touching their bytes. A list that would read past
+ * its end or decode a doc id past the corpus, as only a damaged index
+ * holds, reads as ending there.
+ */
+class PostingCursor {
+    const uint8_t *table = nullptr; // skip table, nullptr for short lists
+    const uint8_t *data = nullptr;  // first block
+    const uint8_t *end = nullptr;
+    int doc_limit = 0;
+    int count = 0;
+    int blocks = 1;
+    int block = -1;
+    int buffered = 0;
+    int position = 0;
+    int buffer[POSTING_BLOCK];
 
-vector<string> parse_query(const string &query_file) {
-    vector<string> queries;
-    string line;
-    fstream fi;
-    fi.open(query_file.c_str(), ios::in);
-    while (getline(fi, line)) {
-        queries.emplace_back(line);
+public:
+    PostingCursor() = default;
+
+    // the list encoded in [encoded, end), over doc ids below doc_limit
+    PostingCursor(const uint8_t *encoded, const uint8_t *end, const int doc_limit) : end(end), doc_limit(doc_limit) {
+        uint32_t total;
+        if (!get_varint(encoded, end, total) || total > (uint32_t) doc_limit) {
+            return;
+        }
+        if (total > POSTING_BLOCK) {
+            blocks = (total + POSTING_BLOCK - 1) / POSTING_BLOCK;
+            if ((size_t) (end - encoded) < (size_t) blocks * 8) {
+                return;
+            }
+            table = encoded;
+            encoded += blocks * 8;
+        }
+        count = total;
+        data = encoded;
+        if (count > 0) {
+            load(0);
+        }
     }
-    fi.close();
-    return queries;
-}
 
-void write_to_file(const string &file_name, const vector<string> &result) {
-    fstream fi;
-    fi.open(file_name.c_str(), ios::out);
-    for (auto &title: result) {
-        cout << title << endl;
-        fi << title << endl;
+    int size() const {
+        return count;
     }
-    fi.close();
-}
 
-vector<string> extract_operators(string &word, vector<char> &operators) {
-    if (word.find(OP_AND) != string::npos) {
-        operators.emplace_back(OP_AND);
+    bool done() const {
+        return position >= buffered;
     }
-    if (word.find(OP_OR) != string::npos) {
-        operators.emplace_back(OP_OR);
+
+    int doc() const {
+        return buffer[position];
     }
-    if (word.find(OP_EXCLUDE) != string::npos) {
-        operators.emplace_back(OP_EXCLUDE);
+
+    // index of the current doc within the list
+    int ordinal() const {
+        return block * POSTING_BLOCK + position;
     }
-    if (operators.empty()) {
-        return {word};
+
+    void next() {
+        if (++position == buffered && block + 1 < blocks) {
+            load(block + 1);
+        }
     }
-    vector<string> tokens;
-    std::sort(operators.begin(), operators.end());
-    std::regex delimiter("\\+|-|/");
-    std::copy(std::sregex_token_iterator(word.begin(), word.end(), delimiter, -1),
-              std::sregex_token_iterator(),
-              std::back_inserter(tokens));
-    return tokens;
-}
 
-string trim(string &w) {
-    return std::regex_replace(w, std::regex("^ +| +$|( ) +"), "$1");
-}
-vector<string> start_query(const vector<Essay *> &essays, vector<string> &query_strings) {
-    vector<string> query_result;
-    vector<string> keywords;
-    vector<char> operations;
-    int search_flag;
-    vector<string> temp;
-    for (auto &query: query_strings) {
-        keywords = extract_operators(query, operations);
-        if (operations.empty()) {
-            search_flag = extract_word(query);
-            for (auto &essay: essays) {
-                if (search_flag == EXACT) {
-                    if (essay->prefix->search(query, true)) {
-                        query_result.emplace_back(essay->name);
-                        continue;
-                    }
-                }
-                if (search_flag == PREFIX) {
-                    if (essay->prefix->search(query, false)) {
-                        query_result.emplace_back(essay->name);
-                        continue;
-                    }
-                }
-                if (search_flag == SUFFIX) {
-                    if (essay->suffix->search(query, false)) {
-                        query_result.emplace_back(essay->name);
-                        continue;
-                    }
-                }
-                temp = split(query, " ");
-                if (essay->prefix->search(temp[0], false) &&
-                    essay->suffix->search(temp[1], false)) {
-                    query_result.emplace_back(essay->name);
-                }
+    // move to the first doc >= target
+    void advance(const int target) {
+        if (done() || doc() >= target) {
+            return;
+        }
+        if (table != nullptr && last_doc(block) < target) {
+            int b = block + 1;
+            while (b < blocks && last_doc(b) < target) {
+                b++;
             }
-        } else {
-            // Operator case
-            set<int> tmp1;
-            set<int> tmp2;
-            set<int> diff;
-            const int num_of_essays = essays.size();
-            string w = trim(keywords.front());
-            keywords.erase(keywords.begin());
-            search_flag = extract_word(w);
-            for (int i = 0; i < num_of_essays; i++) {
-                if (search_flag == EXACT) {
-                    if (essays[i]->prefix->search(w, true)) {
-                        tmp1.insert(i);
-                        continue;
-                    }
-                }
-                if (search_flag == PREFIX) {
-                    if (essays[i]->prefix->search(w, false)) {
-                        tmp1.insert(i);
-                        continue;
-                    }
-                }
-                if (search_flag == SUFFIX) {
-                    if (essays[i]->suffix->search(w, false)) {
-                        tmp1.insert(i);
-                        continue;
-                    }
-                }
-                temp = split(query, " ");
-                if (essays[i]->prefix->search(temp[0], false) &&
-                    essays[i]->suffix->search(temp[1], false)) {
-                    tmp1.insert(i);
-                }
-            }
-
-            for (char &c: operations) {
-                w = trim(keywords.front());
-                keywords.erase(keywords.begin());
-                search_flag = extract_word(w);
-                if (c == OP_AND) {
-                    for (int i = 0; i < num_of_essays; i++) {
-                        if (search_flag == EXACT) {
-                            if (essays[i]->prefix->search(w, true)) {
-                                tmp1.insert(i);
-                                continue;
-                            }
-                        }
-                        if (search_flag == PREFIX) {
-                            if (essays[i]->prefix->search(w, false)) {
-                                tmp1.insert(i);
-                                continue;
-                            }
-                        }
-                        if (search_flag == SUFFIX) {
-                            if (essays[i]->suffix->search(w, false)) {
-                                tmp1.insert(i);
-                                continue;
-                            }
-                        }
-                        temp = split(query, " ");
-                        if (essays[i]->prefix->search(temp[0], false) &&
-                            essays[i]->suffix->search(temp[1], false)) {
-                            tmp1.insert(i);
-                        }
-                    }
-                    continue;
-                }
-                if (c == OP_OR) {
-                    for (int i: tmp1) {
-                        if (search_flag == EXACT) {
-                            if (essays[i]->prefix->search(w, true)) {
-                                tmp2.insert(i);
-                                continue;
-                            }
-                        }
-                        if (search_flag == PREFIX) {
-                            if (essays[i]->prefix->search(w, false)) {
-                                tmp2.insert(i);
-                                continue;
-                            }
-                        }
-                        if (search_flag == SUFFIX) {
-                            if (essays[i]->suffix->search(w, false)) {
-                                tmp2.insert(i);
-                                continue;
-                            }
-                        }
-                        temp = split(query, " ");
-                        if (essays[i]->prefix->search(temp[0], false) &&
-                            essays[i]->suffix->search(temp[1], false)) {
-                            tmp2.insert(i);
-                        }
-                    }
-                    tmp1.clear();
-                    for (int i: tmp2) {
-                        tmp1.insert(i);
-                    }
-                    tmp2.clear();
-                    continue;
-                }
-                if (c == OP_EXCLUDE) {
-                    // OP_EXCLUDE CASE
-                    for (int i = 0; i < num_of_essays; i++) {
-                        if (search_flag == EXACT) {
-                            if (essays[i]->prefix->search(w, true)) {
-                                tmp2.insert(i);
-                                continue;
-                            }
-                        }
-                        if (search_flag == PREFIX) {
-                            if (essays[i]->prefix->search(w, false)) {
-                                tmp2.insert(i);
-                                continue;
-                            }
-                        }
-                        if (search_flag == SUFFIX) {
-                            if (essays[i]->suffix->search(w, false)) {
-                                tmp2.insert(i);
-                                continue;
-                            }
-                        }
-                        temp = split(query, " ");
-                        if (essays[i]->prefix->search(temp[0], false) &&
-                            essays[i]->suffix->search(temp[1], false)) {
-                            tmp2.insert(i);
-                        }
-                    }
-                    set_difference(
-                        tmp1.begin(), tmp1.end(), tmp2.begin(), tmp2.end(),
-                        inserter(diff, diff.begin()));
-                    tmp1.clear();
-                    tmp2.clear();
-                    for (int i: diff) {
-                        tmp1.insert(i);
-                    }
-                    diff.clear();
+            if (b == blocks) {
+                position = buffered;
+                return;
+            }
+            load(b);
+        }
+        while (!done() && doc() < target) {
+            next();
+        }
+    }
+
+private:
+    int64_t last_doc(const int b) const {
+        uint32_t entry[2];
+        memcpy(entry, table + b * 8, sizeof(entry));
+        return entry[0];
+    }
+
+    void load(const int b) {
+        const uint8_t *in = data;
+        int64_t previous = -1;
+        block = b;
+        position = 0;
+        buffered = 0;
+        if (table != nullptr) {
+            uint32_t entry[2];
+            memcpy(entry, table + b * 8, sizeof(entry));
+            if (entry[1] >= (size_t) (end - data)) {
+                return;
+            }
+            in += entry[1];
+            if (b > 0) {
+                memcpy(entry, table + (b - 1) * 8, sizeof(entry));
+                previous = entry[0];
+            }
+        }
+        const int size = std::min(POSTING_BLOCK, count - b * POSTING_BLOCK);
+        if (size < POSTING_BLOCK) {
+            for (int i = 0; i < size; i++) {
+                uint32_t gap;
+                if (!get_varint(in, end, gap) || (previous += gap + (int64_t) 1) >= doc_limit) {
+                    return;
                 }
+                buffer[i] = previous;
             }
-            for (const int i: tmp1) {
-                query_result.emplace_back(essays[i]->name);
+            buffered = size;
+            return;
+        }
+        if (in == end || *in > 32 || (size_t) (end - in - 1) < (size_t) *in * POSTING_BLOCK / 8) {
+            return;
+        }
+        const int bits = *in++;
+        const uint32_t mask = bits == 32 ? ~0u : (1u << bits) - 1;
+        uint64_t bitbuffer = 0;
+        int filled = 0;
+        for (int i = 0; i < POSTING_BLOCK; i++) {
+            while (filled < bits) {
+                bitbuffer |= (uint64_t) *in++ << filled;
+                filled += 8;
             }
+            previous += (bitbuffer & mask) + 1;
+            bitbuffer >>= bits;
+            filled -= bits;
+            buffer[i] = previous;
+        }
+        // gaps only grow the ids, so the last one bounds them all
+        if (previous < doc_limit) {
+            buffered = POSTING_BLOCK;
         }
     }
-    return query_result;
-}
+};
 
-vector<Essay *> parse_essays(const vector<string> &data_set) {
-    vector<Essay *> essays;
-    fstream fi;
-    string title_name, tmp;
-    vector<string> tmp_string;
-    for (auto &essay: data_set) {
-        fi.open(essay.c_str(), ios::in);
-        getline(fi, title_name);
-        tmp_string = split(title_name, " ");
-        vector<string> title = word_parse(tmp_string);
-        auto *new_essay = new Essay(title_name, new TrieTree(), new TrieTree());
-        for (auto &entry: title) {
-            new_essay->prefix->insert(entry);
-            new_essay->suffix->insert_reverse(entry);
+/**
+ * Doc-id set for query evaluation. Small sets are sorted arrays; a set
+ * holding more than 1/32 of the corpus becomes a bitmap over all docs, the
+ * point where the bitmap is the smaller of the two. intersect(), unite()
+ * and subtract() pick their algorithm from the operands' shapes and sizes:
+ *
+ *   bitmap with bitmap          word-wise AND / OR / ANDNOT
+ *   array with bitmap           probe the bitmap for each array element
+ *   arrays of skewed sizes      gallop through the larger from the smaller
+ *   arrays of similar sizes     SIMD block intersection, linear merge
+ */
+class DocSet {
+    int universe = 0;
+    bool is_dense = false;
+    size_t count = 0;
+    vector<int> docs;      // sorted, while sparse
+    vector<uint64_t> bits; // one bit per doc, while dense
+
+public:
+    DocSet() = default;
+
+    DocSet(vector<int> sorted, const int universe): universe(universe), docs(std::move(sorted)) {
+        count = docs.size();
+        reshape();
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    bool dense() const {
+        return is_dense;
+    }
+
+    bool contains(const int doc) const {
+        if (is_dense) {
+            return bits[doc >> 6] >> (doc & 63) & 1;
         }
-        while (getline(fi, tmp)) {
-            // GET CONTENT WORD VECTOR
-            tmp_string = split(tmp, " ");
+        return std::binary_search(docs.begin(), docs.end(), doc);
+    }
 
-            // PARSE CONTENT
-            vector<string> content = word_parse(tmp_string);
-            for (auto &word: content) {
-                new_essay->prefix->insert(word);
-                new_essay->suffix->insert_reverse(word);
+    // visit the docs in increasing order
+    template<typename F>
+    void for_each(F &&visit) const {
+        if (!is_dense) {
+            for (const int doc: docs) {
+                visit(doc);
+            }
+            return;
+        }
+        const int words = bits.size();
+        for (int w = 0; w < words; w++) {
+            for (uint64_t word = bits[w]; word != 0; word &= word - 1) {
+                visit(w * 64 + __builtin_ctzll(word));
             }
         }
-        essays.emplace_back(new_essay);
-        fi.close();
     }
-    return essays;
-}
 
-bool comparator(const string a, const string b) {
-    string s1 = a.substr(5, a.length() - 9);
-    string s2 = b.substr(5, b.length() - 9);
-    return stoi(s1) < stoi(s2);
-}
+    vector<int> to_vector() const {
+        if (!is_dense) {
+            return docs;
+        }
+        vector<int> out;
+        out.reserve(count);
+        for_each([&](const int doc) { out.emplace_back(doc); });
+        return out;
+    }
 
-int main(int argc, char *argv[]) {
-    // INPUT :
-    // 1. data directory in data folder
-    // 2. number of txt files
-    // 3. output route
+    friend DocSet intersect(const DocSet &a, const DocSet &b);
+    friend DocSet unite(const DocSet &a, const DocSet &b);
+    friend DocSet subtract(const DocSet &a, const DocSet &b);
 
-    string data_dir = argv[1] + string("/");
-    string query = string(argv[2]);
-    string output = string(argv[3]);
+private:
+    static DocSet sparse(vector<int> sorted, const int universe) {
+        return DocSet(std::move(sorted), universe);
+    }
 
+    static DocSet bitmap(vector<uint64_t> words, const int universe) {
+        DocSet set;
+        set.universe = universe;
+        set.is_dense = true;
+        set.bits = std::move(words);
+        for (const uint64_t word: set.bits) {
+            set.count += __builtin_popcountll(word);
+        }
+        set.reshape();
+        return set;
+    }
 
-    // Read File & Parser Example
-    vector<string> data_set;
-    //for (const auto &entry: std::filesystem::directory_iterator(data_dir)) {
-    //    //std::cout << entry.path() << std::endl;
-    //    data_set.emplace_back(entry.path().string());
-    //}
-    data_set.emplace_back("data.txt");
-    std::sort(data_set.begin(), data_set.end(), comparator);
+    vector<uint64_t> to_bitmap() const {
+        if (is_dense) {
+            return bits;
+        }
+        vector<uint64_t> words((universe + 63) / 64);
+        for (const int doc: docs) {
+            words[doc >> 6] |= 1ull << (doc & 63);
+        }
+        return words;
+    }
 
-    vector<string> queries = parse_query(query);
-    vector<Essay *> essays = parse_essays(data_set);
-    vector<string> result = start_query(essays, queries);
+    // switch representation when the size crosses the threshold, with
+    // some slack so sets near it do not flip back and forth
+    void reshape() {
+        if (!is_dense && (long long) count * 32 > universe) {
+            bits = to_bitmap();
+            vector<int>().swap(docs);
+            is_dense = true;
+        } else if (is_dense && (long long) count * 64 < universe) {
+            docs = to_vector();
+            vector<uint64_t>().swap(bits);
+            is_dense = false;
+        }
+    }
+
+    template<typename Keep>
+    static DocSet filtered(const vector<int> &docs, const int universe, Keep keep) {
+        vector<int> out;
+        for (const int doc: docs) {
+            if (keep(doc)) {
+                out.emplace_back(doc);
+            }
+        }
+        return sparse(std::move(out), universe);
+    }
+};
+
+// first index >= from with list[index] >= target, by exponential then binary search
+size_t gallop(const vector<int> &list, size_t from, const int target) {
+    size_t step = 1;
+    size_t high = from;
+    while (high < list.size() && list[high] < target) {
+        from = high + 1;
+        high += step;
+        step *= 2;
+    }
+    return std::lower_bound(list.begin() + from, list.begin() + std::min(high, list.size()), target) - list.begin();
+}
 
-    write_to_file(output, result);
+// skewed when the larger list is this many times the smaller
+const size_t GALLOP_RATIO = 32;
 
-    // delete all essay
-    for (const auto &essay: essays) {
-        delete essay;
+void intersect_galloping(const vector<int> &small, const vector<int> &large, vector<int> &out) {
+    size_t at = 0;
+    for (const int doc: small) {
+        at = gallop(large, at, doc);
+        if (at == large.size()) {
+            return;
+        }
+        if (large[at] == doc) {
+            out.emplace_back(doc);
+        }
     }
 }
 
+/**
+ * Intersection of two similar-sized sorted lists, four by four: each block
+ * of a is compared against all rotations of the block of b at once, then
+ * whichever block ends lower is retired. Scalar merge for the tails.
+ */
+void intersect_merge(const vector<int> &a, const vector<int> &b, vector<int> &out) {
+    size_t i = 0, j = 0;
+#if defined(__SSE2__)
+    while (i + 4 <= a.size() && j + 4 <= b.size()) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&a[i]));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&b[j]));
+        __m128i hits = _mm_cmpeq_epi32(va, vb);
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1))));
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))));
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3))));
+        for (int mask = _mm_movemask_ps(_mm_castsi128_ps(hits)); mask != 0; mask &= mask - 1) {
+            out.emplace_back(a[i + __builtin_ctz(mask)]);
+        }
+        const int a_last = a[i + 3], b_last = b[j + 3];
+        if (a_last <= b_last) {
+            i += 4;
+        }
+        if (b_last <= a_last) {
+            j += 4;
+        }
+    }
+#endif
+    while (i < a.size() && j < b.size()) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (b[j] < a[i]) {
+            j++;
+        } else {
+            out.emplace_back(a[i]);
+            i++;
+            j++;
+        }
+    }
+}
+
+DocSet intersect(const DocSet &a, const DocSet &b) {
+    const int universe = std::max(a.universe, b.universe);
+    if (a.is_dense && b.is_dense) {
+        vector<uint64_t> words(a.bits.size());
+        for (size_t w = 0; w < words.size(); w++) {
+            words[w] = a.bits[w] & b.bits[w];
+        }
+        return DocSet::bitmap(std::move(words), universe);
+    }
+    if (a.is_dense || b.is_dense) {
+        const DocSet &array = a.is_dense ? b : a;
+        const DocSet &map = a.is_dense ? a : b;
+        return DocSet::filtered(array.docs, universe, [&](const int doc) { return map.contains(doc); });
+    }
+    const vector<int> &small = a.size() <= b.size() ? a.docs : b.docs;
+    const vector<int> &large = a.size() <= b.size() ? b.docs : a.docs;
+    vector<int> out;
+    if (small.size() * GALLOP_RATIO < large.size()) {
+        intersect_galloping(small, large, out);
+    } else {
+        intersect_merge(small, large, out);
+    }
+    return DocSet::sparse(std::move(out), universe);
+}
+
+DocSet unite(const DocSet &a, const DocSet &b) {
+    const int universe = std::max(a.universe, b.universe);
+    if (a.is_dense || b.is_dense) {
+        vector<uint64_t> words = a.is_dense ? a.bits : b.bits;
+        const DocSet &other = a.is_dense ? b : a;
+        if (other.is_dense) {
+            for (size_t w = 0; w < words.size(); w++) {
+                words[w] |= other.bits[w];
+            }
+        } else {
+            for (const int doc: other.docs) {
+                words[doc >> 6] |= 1ull << (doc & 63);
+            }
+        }
+        return DocSet::bitmap(std::move(words), universe);
+    }
+    vector<int> out;
+    out.reserve(a.size() + b.size());
+    std::set_union(a.docs.begin(), a.docs.end(), b.docs.begin(), b.docs.end(), back_inserter(out));
+    return DocSet::sparse(std::move(out), universe);
+}
+
+DocSet subtract(const DocSet &a, const DocSet &b) {
+    const int universe = std::max(a.universe, b.universe);
+    if (a.is_dense) {
+        vector<uint64_t> words = a.bits;
+        if (b.is_dense) {
+            for (size_t w = 0; w < words.size(); w++) {
+                words[w] &= ~b.bits[w];
+            }
+        } else {
+            for (const int doc: b.docs) {
+                words[doc >> 6] &= ~(1ull << (doc & 63));
+            }
+        }
+        return DocSet::bitmap(std::move(words), universe);
+    }
+    if (b.is_dense) {
+        return DocSet::filtered(a.docs, universe, [&](const int doc) { return !b.contains(doc); });
+    }
+    vector<int> out;
+    if (a.size() * GALLOP_RATIO < b.size()) {
+        size_t at = 0;
+        for (const int doc: a.docs) {
+            at = gallop(b.docs, at, doc);
+            if (at == b.docs.size() || b.docs[at] != doc) {
+                out.emplace_back(doc);
+            }
+        }
+    } else {
+        std::set_difference(a.docs.begin(), a.docs.end(), b.docs.begin(), b.docs.end(), back_inserter(out));
+    }
+    return DocSet::sparse(std::move(out), universe);
+}
+
+/**
+ * On-disk index layout. The file is the header followed by 8-byte aligned
+ * sections; every position is an offset from the start of the file, so the
+ * file can be mapped anywhere and used in place. Integers are stored in the
+ * host's native (little-endian) layout. An in-memory build freezes into
+ * exactly this image, so built and loaded indexes share one query path.
+ */
+const char INDEX_MAGIC[8] = {'E', 'S', 'S', 'A', 'Y', 'I', 'D', 'X'};
+const uint32_t INDEX_VERSION = 7;
+
+enum IndexSection {
+    TITLE_OFFSETS,   // uint32 per doc + 1, into TITLE_BYTES
+    TITLE_BYTES,
+    TERM_OFFSETS,    // uint32 per term + 1, into TERM_BYTES; term ids follow sorted word order
+    TERM_BYTES,
+    POSTING_OFFSETS, // uint32 per term + 1, into POSTING_BYTES
+    POSTING_BYTES,   // encoded posting lists, see PostingEncoder
+    DICTIONARY_STATES, // dictionary automaton arena, see Dawg
+    DICTIONARY_EDGES,
+    SUFFIX_ORDER,    // uint32 term ids sorted by their words read backwards
+    TEXT_SUFFIXES,   // uint32 offsets into TERM_BYTES, sorted by the bytes from there to the end
+    GRAM_OFFSETS,    // uint32 per bigram + 1, into GRAM_TERMS
+    GRAM_TERMS,      // uint32 term ids, ascending within each bigram
+    DOC_LENGTHS,     // uint32 words per doc
+    FREQ_OFFSETS,    // uint32 per term + 1, into FREQUENCIES
+    FREQUENCIES,     // uint16 occurrences per posting in posting order, saturating
+    TERM_BOUNDS,     // float per term, the largest BM25 weight any of its postings has
+    POSITION_OFFSETS, // uint32 per posting + 1 (numbered as in FREQUENCIES), into POSITION_BYTES
+    POSITION_BYTES,   // word offsets of each posting as varint gaps (offset - previous - 1)
+    SECTION_COUNT
+};
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sections;
+    uint64_t size;     // bytes in the whole file
+    uint64_t checksum; // FNV-1a over every byte after the header
+    uint64_t offset[SECTION_COUNT];
+    uint64_t length[SECTION_COUNT];
+};
+
+// pass the previous result as hash to continue a checksum over more bytes
+uint64_t fnv1a(const char *bytes, const size_t length, uint64_t hash = 14695981039346656037ull) {
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * Wildcard support. Every term is padded with a boundary mark on both ends
+ * and each adjacent pair of characters is a bigram, so "cat" files under
+ * $c, ca, at and t$. A pattern such as exp*at*n yields the bigrams its
+ * literal runs must contain ($e, ex, xp, at, n$); intersecting their term
+ * lists leaves a short candidate list that wildcard_match() then verifies.
+ */
+const int GRAM_BOUNDARY = 26;
+const int GRAM_COUNT = 27 * 27;
+
+int gram_id(const int a, const int b) {
+    return a * 27 + b;
+}
+
+// bigrams a term matching pattern must contain; false if nothing can match
+bool pattern_grams(const string &pattern, vector<int> &grams) {
+    int prev = GRAM_BOUNDARY;
+    for (const char ch: pattern) {
+        if (ch == '*') {
+            prev = -1;
+            continue;
+        }
+        if (ch < 'a' || ch > 'z') {
+            return false;
+        }
+        if (prev >= 0) {
+            grams.emplace_back(gram_id(prev, ch - 'a'));
+        }
+        prev = ch - 'a';
+    }
+    if (prev >= 0) {
+        grams.emplace_back(gram_id(prev, GRAM_BOUNDARY));
+    }
+    std::sort(grams.begin(), grams.end());
+    grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+    return true;
+}
+
+// whole-word glob match, '*' matches any run of letters
+bool wildcard_match(string_view word, string_view pattern) {
+    size_t w = 0, p = 0, star = string_view::npos, resume = 0;
+    while (w < word.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            resume = w;
+        } else if (p < pattern.size() && pattern[p] == word[w]) {
+            p++;
+            w++;
+        } else if (star != string_view::npos) {
+            // let the last star swallow one more letter and retry
+            p = star + 1;
+            w = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+/**
+ * Okapi BM25. A term's weight in a doc grows with its count there but
+ * saturates (k1), and is scaled by the doc's length relative to the
+ * average (b); the idf factor favours rare terms.
+ */
+const double BM25_K1 = 1.2;
+const double BM25_B = 0.75;
+
+double bm25_idf(const int document_frequency, const int documents) {
+    return log(1.0 + (documents - document_frequency + 0.5) / (document_frequency + 0.5));
+}
+
+double bm25_weight(const int frequency, const uint32_t length, const double average_length) {
+    return frequency * (BM25_K1 + 1) /
+           (frequency + BM25_K1 * (1 - BM25_B + BM25_B * length / average_length));
+}
+
+double average_length(const uint32_t *lengths, const int documents) {
+    uint64_t total = 0;
+    for (int d = 0; d < documents; d++) {
+        total += lengths[d];
+    }
+    return documents == 0 ? 1.0 : std::max(1.0, (double) total / documents);
+}
+
+/**
+ * Append-only byte buffer that moves its contents to an unnamed temporary
+ * file whenever it holds more than limit bytes, so that the large sections
+ * of an external build never have to fit in memory at once.
+ */
+class SpillBuffer {
+public:
+    explicit SpillBuffer(const size_t limit = SIZE_MAX) : limit(limit) {
+    }
+
+    ~SpillBuffer() {
+        if (spill != nullptr) {
+            fclose(spill);
+        }
+    }
+
+    SpillBuffer(const SpillBuffer &) = delete;
+    SpillBuffer &operator=(const SpillBuffer &) = delete;
+
+    void append(const void *data, const size_t length) {
+        buffer.append((const char *) data, length);
+        if (buffer.size() > limit) {
+            if (spill == nullptr) {
+                spill = tmpfile();
+            }
+            if (spill == nullptr || fwrite(buffer.data(), 1, buffer.size(), spill) != buffer.size()) {
+                failed = true;
+            }
+            spilled += buffer.size();
+            buffer.clear();
+        }
+    }
+
+    size_t size() const {
+        return spilled + buffer.size();
+    }
+
+    // write over length bytes from position, all of which were appended already
+    void overwrite(size_t position, const void *data, size_t length) {
+        const char *bytes = (const char *) data;
+        if (position < spilled && length > 0) {
+            const size_t n = std::min(length, spilled - position);
+            if (fseek(spill, position, SEEK_SET) != 0 || fwrite(bytes, 1, n, spill) != n) {
+                failed = true;
+            }
+            fseek(spill, 0, SEEK_END);
+            position += n;
+            bytes += n;
+            length -= n;
+        }
+        if (length > 0) {
+            memcpy(&buffer[position - spilled], bytes, length);
+        }
+    }
+
+    // false once a write to the spill file has failed
+    bool good() const {
+        return !failed;
+    }
+
+    // hand every byte, spilled ones first, to emit(data, length) in chunks
+    template<typename Emit>
+    bool replay(Emit emit) const {
+        if (spill != nullptr) {
+            rewind(spill);
+            char chunk[64 * 1024];
+            for (size_t left = spilled; left > 0;) {
+                const size_t n = fread(chunk, 1, std::min(left, sizeof(chunk)), spill);
+                if (n == 0) {
+                    failed = true;
+                    return false;
+                }
+                emit(chunk, n);
+                left -= n;
+            }
+            fseek(spill, 0, SEEK_END);
+        }
+        emit(buffer.data(), buffer.size());
+        return !failed;
+    }
+
+private:
+    size_t limit;
+    string buffer;
+    FILE *spill = nullptr;
+    size_t spilled = 0;
+    mutable bool failed = false;
+};
+
+/**
+ * The sections of an index image that only depend on the vocabulary,
+ * given as the sorted distinct words: term text, the dictionary automaton,
+ * the suffix order, the suffix array and the wildcard bigram lists.
+ */
+struct WordSections {
+    vector<uint32_t> term_offsets = {0};
+    string term_bytes;
+    vector<DawgState> states;
+    vector<uint32_t> edges;
+    vector<uint32_t> suffix_order;
+    vector<uint32_t> text_suffixes;
+    vector<uint32_t> gram_offsets = {0};
+    vector<uint32_t> gram_terms;
+
+    explicit WordSections(const vector<string> &words) {
+        Dawg::build(words, states, edges);
+        suffix_order.resize(words.size());
+        for (uint32_t t = 0; t < suffix_order.size(); t++) {
+            suffix_order[t] = t;
+        }
+        std::sort(suffix_order.begin(), suffix_order.end(), [&](const uint32_t a, const uint32_t b) {
+            return std::lexicographical_compare(words[a].rbegin(), words[a].rend(), words[b].rbegin(), words[b].rend());
+        });
+        for (auto &word: words) {
+            term_bytes += word;
+            term_offsets.emplace_back(term_bytes.size());
+        }
+        // suffix array over the vocabulary text, for substring terms
+        text_suffixes.resize(term_bytes.size());
+        for (uint32_t i = 0; i < text_suffixes.size(); i++) {
+            text_suffixes[i] = i;
+        }
+        const string_view text = term_bytes;
+        std::sort(text_suffixes.begin(), text_suffixes.end(), [&](const uint32_t a, const uint32_t b) {
+            return text.substr(a) < text.substr(b);
+        });
+        vector<vector<uint32_t>> gram_lists(GRAM_COUNT);
+        for (uint32_t t = 0; t < words.size(); t++) {
+            int prev = GRAM_BOUNDARY;
+            for (const char ch: words[t] + '{') {
+                // '{' follows 'z', so it stands for the closing boundary
+                const int c = ch - 'a';
+                vector<uint32_t> &list = gram_lists[gram_id(prev, c)];
+                if (list.empty() || list.back() != t) {
+                    list.emplace_back(t);
+                }
+                prev = c;
+            }
+        }
+        for (auto &list: gram_lists) {
+            gram_terms.insert(gram_terms.end(), list.begin(), list.end());
+            gram_offsets.emplace_back(gram_terms.size());
+        }
+    }
+};
+
+/**
+ * The sections of an index image that grow with the postings, filled one
+ * term at a time in term id order and one posting at a time within a term.
+ * The byte sections are spill buffers, which never spill in an in-memory
+ * build.
+ */
+struct TermSections {
+    vector<uint32_t> posting_offsets = {0};
+    vector<uint32_t> freq_offsets = {0};
+    vector<float> bounds;
+    SpillBuffer posting_bytes;
+    SpillBuffer frequencies;      // uint16 each
+    SpillBuffer position_offsets; // uint32 each
+    SpillBuffer position_bytes;
+
+    TermSections(const uint32_t *doc_lengths, const double average, const size_t limit = SIZE_MAX)
+        : posting_bytes(limit), frequencies(limit), position_offsets(limit), position_bytes(limit),
+          doc_lengths(doc_lengths), average(average) {
+        const uint32_t zero = 0;
+        position_offsets.append(&zero, sizeof(zero));
+    }
+
+    // begin the next term, which has count postings
+    void start(const int count) {
+        encoded.clear();
+        encoder.start(count, encoded);
+        table_at = posting_bytes.size() + encoded.size() - encoder.skip_table().size() * sizeof(uint32_t);
+        posting_bytes.append(encoded.data(), encoded.size());
+        best = 0;
+    }
+
+    // the term's next doc id, with the count word offsets it has in that doc
+    void add_posting(const int doc, const uint32_t *offsets, const uint32_t count) {
+        encoded.clear();
+        encoder.add(doc, encoded);
+        posting_bytes.append(encoded.data(), encoded.size());
+        const uint16_t frequency = std::min<uint32_t>(count, UINT16_MAX);
+        frequencies.append(&frequency, sizeof(frequency));
+        encoded.clear();
+        int previous = -1;
+        for (uint32_t i = 0; i < count; i++) {
+            put_varint(encoded, offsets[i] - previous - 1);
+            previous = offsets[i];
+        }
+        position_bytes.append(encoded.data(), encoded.size());
+        const uint32_t end = position_bytes.size();
+        position_offsets.append(&end, sizeof(end));
+        best = std::max(best, bm25_weight(count, doc_lengths[doc], average));
+    }
+
+    void finish() {
+        const vector<uint32_t> &table = encoder.skip_table();
+        posting_bytes.overwrite(table_at, table.data(), table.size() * sizeof(uint32_t));
+        posting_offsets.emplace_back(posting_bytes.size());
+        freq_offsets.emplace_back(frequencies.size() / sizeof(uint16_t));
+        // rounded up, so the stored bound never undercuts a real weight
+        bounds.emplace_back(nextafterf((float) best, INFINITY));
+    }
+
+    // a whole term: doc ids, their counts and the counts' worth of word offsets for each
+    void add(const vector<int> &list, const vector<uint32_t> &counts, const vector<uint32_t> &offsets) {
+        start(list.size());
+        for (size_t i = 0, at = 0; i < list.size(); at += counts[i], i++) {
+            add_posting(list[i], offsets.data() + at, counts[i]);
+        }
+        finish();
+    }
+
+    bool good() const {
+        return posting_bytes.good() && frequencies.good() && position_offsets.good() && position_bytes.good();
+    }
+
+    // false once a byte or posting offset no longer fits the image's 32-bit offset tables
+    bool fits() const {
+        return posting_bytes.size() <= UINT32_MAX && position_bytes.size() <= UINT32_MAX &&
+               frequencies.size() / sizeof(uint16_t) <= UINT32_MAX;
+    }
+
+private:
+    const uint32_t *doc_lengths;
+    double average;
+    PostingEncoder encoder;
+    size_t table_at = 0; // the current term's skip table in posting_bytes
+    string encoded;
+    double best = 0;
+};
+
+/**
+ * Stream an index image through emit(data, length) in file order: a zeroed
+ * header, then every section 8-byte aligned. Returns the finished header,
+ * which the caller writes over the zeroed one.
+ */
+template<typename Emit>
+IndexHeader write_image(const vector<uint32_t> &title_offsets, const SpillBuffer &title_bytes,
+                        const vector<uint32_t> &doc_lengths, const WordSections &words,
+                        const TermSections &terms, Emit emit) {
+    IndexHeader header{};
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.sections = SECTION_COUNT;
+    uint64_t size = 0;
+    uint64_t checksum = fnv1a(nullptr, 0);
+    auto write = [&](const char *data, const size_t length) {
+        emit(data, length);
+        checksum = size == 0 ? checksum : fnv1a(data, length, checksum);
+        size += length;
+    };
+    const IndexHeader blank{};
+    write((const char *) &blank, sizeof(blank));
+    auto start = [&](const IndexSection section) {
+        static const char padding[8] = {};
+        write(padding, (8 - size % 8) % 8);
+        header.offset[section] = size;
+    };
+    auto put = [&](const IndexSection section, const void *data, const size_t length) {
+        start(section);
+        write((const char *) data, length);
+        header.length[section] = length;
+    };
+    auto put_spilled = [&](const IndexSection section, const SpillBuffer &buffer) {
+        start(section);
+        buffer.replay(write);
+        header.length[section] = buffer.size();
+    };
+    put(TITLE_OFFSETS, title_offsets.data(), title_offsets.size() * sizeof(uint32_t));
+    put_spilled(TITLE_BYTES, title_bytes);
+    put(TERM_OFFSETS, words.term_offsets.data(), words.term_offsets.size() * sizeof(uint32_t));
+    put(TERM_BYTES, words.term_bytes.data(), words.term_bytes.size());
+    put(POSTING_OFFSETS, terms.posting_offsets.data(), terms.posting_offsets.size() * sizeof(uint32_t));
+    put_spilled(POSTING_BYTES, terms.posting_bytes);
+    put(DICTIONARY_STATES, words.states.data(), words.states.size() * sizeof(DawgState));
+    put(DICTIONARY_EDGES, words.edges.data(), words.edges.size() * sizeof(uint32_t));
+    put(SUFFIX_ORDER, words.suffix_order.data(), words.suffix_order.size() * sizeof(uint32_t));
+    put(TEXT_SUFFIXES, words.text_suffixes.data(), words.text_suffixes.size() * sizeof(uint32_t));
+    put(GRAM_OFFSETS, words.gram_offsets.data(), words.gram_offsets.size() * sizeof(uint32_t));
+    put(GRAM_TERMS, words.gram_terms.data(), words.gram_terms.size() * sizeof(uint32_t));
+    put(DOC_LENGTHS, doc_lengths.data(), doc_lengths.size() * sizeof(uint32_t));
+    put(FREQ_OFFSETS, terms.freq_offsets.data(), terms.freq_offsets.size() * sizeof(uint32_t));
+    put_spilled(FREQUENCIES, terms.frequencies);
+    put(TERM_BOUNDS, terms.bounds.data(), terms.bounds.size() * sizeof(float));
+    put_spilled(POSITION_OFFSETS, terms.position_offsets);
+    put_spilled(POSITION_BYTES, terms.position_bytes);
+    header.size = size;
+    header.checksum = checksum;
+    return header;
+}
+
+/**
+ * Corpus-wide index: a dictionary automaton mapping every distinct word to
+ * its term id and so to a sorted posting list of doc ids, plus the term ids
+ * in reversed word order for suffix queries. Doc ids are essay indices, so
+ * posting order is output order.
+ *
+ * Documents are added to the build structures; freeze() then packs
+ * everything into a single index image which all lookups read from, and
+ * which save() writes out as is. load() maps a saved image instead.
+ */
+class InvertedIndex {
+public:
+    int add_document(string_view title) {
+        title_bytes.append(title.data(), title.size());
+        title_offsets.emplace_back(title_bytes.size());
+        doc_lengths.emplace_back(0);
+        build_bytes += title.size() + 2 * sizeof(uint32_t);
+        return title_offsets.size() - 2;
+    }
+
+    void add_word(const int doc, string_view word) {
+        if (word.empty()) {
+            return;
+        }
+        const int term = intern(word);
+        vector<int> &list = postings[term];
+        vector<uint32_t> &counts = frequencies[term];
+        if (list.empty() || list.back() != doc) {
+            list.emplace_back(doc);
+            counts.emplace_back(1);
+            build_bytes += sizeof(int) + sizeof(uint32_t);
+        } else {
+            counts.back()++;
+        }
+        positions[term].emplace_back(doc_lengths[doc]++);
+        build_bytes += sizeof(uint32_t);
+    }
+
+    /**
+     * Append a shard built over the essays that directly follow this index's
+     * last doc. Shard terms are visited in their own first-seen order, so
+     * merging shards in doc order assigns the same term ids a sequential
+     * build would.
+     */
+    void merge(const InvertedIndex &shard) {
+        const int offset = title_offsets.size() - 1;
+        const uint32_t shift = title_bytes.size();
+        title_bytes += shard.title_bytes;
+        for (size_t d = 1; d < shard.title_offsets.size(); d++) {
+            title_offsets.emplace_back(shard.title_offsets[d] + shift);
+        }
+        doc_lengths.insert(doc_lengths.end(), shard.doc_lengths.begin(), shard.doc_lengths.end());
+        const int shard_terms = shard.terms.size();
+        for (int t = 0; t < shard_terms; t++) {
+            const int term = intern(shard.terms[t]);
+            for (const int doc: shard.postings[t]) {
+                postings[term].emplace_back(doc + offset);
+            }
+            frequencies[term].insert(frequencies[term].end(), shard.frequencies[t].begin(), shard.frequencies[t].end());
+            positions[term].insert(positions[term].end(), shard.positions[t].begin(), shard.positions[t].end());
+        }
+    }
+
+    /**
+     * Add the postings of a frozen segment, renumbering its docs through
+     * remap (-1 drops a doc). Titles are not copied, so add the surviving
+     * documents first. Lists fed from several segments can come out of
+     * order; freeze() sorts them.
+     */
+    void absorb(const InvertedIndex &segment, const vector<int> &remap) {
+        for (size_t d = 0; d < remap.size(); d++) {
+            if (remap[d] >= 0) {
+                doc_lengths[remap[d]] = segment.document_length(d);
+            }
+        }
+        vector<uint32_t> offsets;
+        for (int t = 0; t < segment.term_count(); t++) {
+            int term = -1;
+            for (PostingCursor it = segment.cursor(t); !it.done(); it.next()) {
+                const int doc = remap[it.doc()];
+                if (doc < 0) {
+                    continue;
+                }
+                if (term < 0) {
+                    term = intern(segment.term(t));
+                }
+                segment.word_offsets(t, it.ordinal(), offsets);
+                postings[term].emplace_back(doc);
+                frequencies[term].emplace_back(offsets.size());
+                positions[term].insert(positions[term].end(), offsets.begin(), offsets.end());
+            }
+        }
+    }
+
+    // pack the build structures into the index image and release them
+    void freeze() {
+        const vector<uint32_t> order = sorted_terms();
+        vector<string> words;
+        words.reserve(order.size());
+        for (const uint32_t t: order) {
+            words.emplace_back(std::move(terms[t]));
+        }
+        const WordSections word_sections(words);
+        TermSections term_sections(doc_lengths.data(), average_length(doc_lengths.data(), doc_lengths.size()));
+        for (const uint32_t t: order) {
+            if (!std::is_sorted(postings[t].begin(), postings[t].end())) {
+                sort_postings(postings[t], frequencies[t], positions[t]);
+            }
+            term_sections.add(postings[t], frequencies[t], positions[t]);
+        }
+        SpillBuffer titles;
+        titles.append(title_bytes.data(), title_bytes.size());
+
+        vector<char> out;
+        const IndexHeader header = write_image(title_offsets, titles, doc_lengths, word_sections, term_sections,
+                                               [&](const char *data, const size_t length) {
+                                                   out.insert(out.end(), data, data + length);
+                                               });
+        memcpy(out.data(), &header, sizeof(IndexHeader));
+
+        vector<uint32_t>().swap(title_offsets);
+        string().swap(title_bytes);
+        vector<string>().swap(terms);
+        vocabulary = TrieTree();
+        vector<vector<int>>().swap(postings);
+        vector<vector<uint32_t>>().swap(frequencies);
+        vector<vector<uint32_t>>().swap(positions);
+        vector<uint32_t>().swap(doc_lengths);
+        image.swap(out);
+        attach(image.data());
+    }
+
+    /**
+     * Write the build lists to file in word order as one run of an external
+     * build, with doc ids following the docs already in the given tables,
+     * then append this index's docs to those tables.
+     */
+    void spill_run(FILE *file, vector<uint32_t> &all_title_offsets, SpillBuffer &all_titles,
+                   vector<uint32_t> &all_doc_lengths) const {
+        const int doc_base = all_title_offsets.size() - 1;
+        string record;
+        for (const uint32_t t: sorted_terms()) {
+            record.clear();
+            put_varint(record, terms[t].size());
+            record += terms[t];
+            put_varint(record, postings[t].size());
+            int previous = -1;
+            for (size_t i = 0, at = 0; i < postings[t].size(); i++) {
+                put_varint(record, postings[t][i] + doc_base - previous - 1);
+                previous = postings[t][i] + doc_base;
+                put_varint(record, frequencies[t][i]);
+                int offset = -1;
+                for (const size_t stop = at + frequencies[t][i]; at < stop; at++) {
+                    put_varint(record, positions[t][at] - offset - 1);
+                    offset = positions[t][at];
+                }
+            }
+            fwrite(record.data(), 1, record.size(), file);
+        }
+        const uint32_t shift = all_titles.size();
+        all_titles.append(title_bytes.data(), title_bytes.size());
+        for (size_t d = 1; d < title_offsets.size(); d++) {
+            all_title_offsets.emplace_back(title_offsets[d] + shift);
+        }
+        all_doc_lengths.insert(all_doc_lengths.end(), doc_lengths.begin(), doc_lengths.end());
+    }
+
+    // rough bytes held by the build structures
+    size_t build_size() const {
+        return build_bytes;
+    }
+
+    bool save(const string &path) const {
+        ofstream fo(path, ios::out | ios::binary);
+        fo.write(base, ((const IndexHeader *) base)->size);
+        return fo.good();
+    }
+
+    // map a saved index; false with a reason when the file is not usable.
+    // Only the header, the section table and the ends of the offset tables
+    // are checked, so the start touches a few pages; verify() reads
+    // everything, and lookups check each entry they follow.
+    bool load(const string &path, string &error) {
+        mapping = make_unique<MappedFile>(path);
+        if (!mapping->is_open()) {
+            error = "cannot open " + path;
+            return false;
+        }
+        const char *data = mapping->data();
+        const size_t size = mapping->size();
+        IndexHeader header{};
+        if (size < sizeof(IndexHeader)) {
+            error = path + " is too short to be an index";
+            return false;
+        }
+        memcpy(&header, data, sizeof(IndexHeader));
+        if (memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+            error = path + " is not an index file";
+            return false;
+        }
+        if (header.version != INDEX_VERSION || header.sections != SECTION_COUNT) {
+            error = path + " has index version " + to_string(header.version) +
+                    ", expected " + to_string(INDEX_VERSION);
+            return false;
+        }
+        if (header.size != size) {
+            error = path + " is truncated";
+            return false;
+        }
+        for (int s = 0; s < SECTION_COUNT; s++) {
+            if (header.offset[s] % 8 != 0 || header.offset[s] > size ||
+                header.length[s] > size - header.offset[s]) {
+                error = path + " has a corrupt section table";
+                return false;
+            }
+        }
+        const char *damage = check_tables(data, header);
+        if (damage != nullptr) {
+            error = path + " is damaged: " + damage;
+            return false;
+        }
+        vector<char>().swap(image);
+        attach(data);
+        return true;
+    }
+
+    // false when the image no longer matches the checksum it was written with
+    bool verify() const {
+        return fnv1a(base + sizeof(IndexHeader), header().size - sizeof(IndexHeader)) == header().checksum;
+    }
+
+    // changes whenever the indexed content does; compiled queries are only valid within one generation
+    uint64_t generation() const {
+        return current_generation;
+    }
+
+    int document_count() const {
+        return header().length[TITLE_OFFSETS] / sizeof(uint32_t) - 1;
+    }
+
+    string_view title(const int doc) const {
+        return slice(TITLE_OFFSETS, TITLE_BYTES, doc);
+    }
+
+    int term_count() const {
+        return header().length[TERM_OFFSETS] / sizeof(uint32_t) - 1;
+    }
+
+    string_view term(const int id) const {
+        return slice(TERM_OFFSETS, TERM_BYTES, id);
+    }
+
+    /**
+     * Dictionary term ids matching word under the given search flag. For
+     * PHRASE and NEAR, word holds space separated words and the result is
+     * their term ids in order, or nothing when one is not in the corpus.
+     */
+    vector<int> resolve(const string &word, const int search_flag) const {
+        vector<int> matched;
+        if (search_flag == PHRASE || search_flag == NEAR) {
+            istringstream words(word);
+            for (string each; words >> each;) {
+                const int term = find_term(each);
+                if (term < 0) {
+                    return {};
+                }
+                matched.emplace_back(term);
+            }
+        } else if (search_flag == EXACT) {
+            const int term = find_term(word);
+            if (term >= 0) {
+                matched.emplace_back(term);
+            }
+        } else if (search_flag == PREFIX) {
+            int first, count;
+            if (dictionary.prefix_range(word, first, count)) {
+                for (int term = first; term < first + count; term++) {
+                    matched.emplace_back(term);
+                }
+            }
+        } else if (search_flag == SUFFIX) {
+            match_suffix(word, matched);
+        } else if (search_flag == SUBSTRING) {
+            match_substring(word, matched);
+        } else if (search_flag == FUZZY) {
+            // the edit budget travels after the word as "word~k"
+            const size_t tilde = word.rfind('~');
+            const int edits = tilde == string::npos ? 0 : stoi(word.substr(tilde + 1));
+            dictionary.collect_within(word.substr(0, tilde), edits, matched);
+        } else {
+            match_wildcard(word, matched);
+        }
+        return matched;
+    }
+
+    // sorted doc ids of the essays matching a single word under the given search flag
+    vector<int> lookup(const string &word, const int search_flag) const {
+        return merge_postings(resolve(word, search_flag));
+    }
+
+    // essays containing any of terms, limited to doc ids in [begin, end)
+    DocSet docs(const vector<int> &terms, const int begin = 0, const int end = INT_MAX) const {
+        return DocSet(merge_postings(terms, begin, end), document_count());
+    }
+
+    int document_frequency(const int term) const {
+        return cursor(term).size();
+    }
+
+    PostingCursor cursor(const int term) const {
+        if (!in_range(term >= 0 && term < term_count() && posting_offsets[term] <= posting_offsets[term + 1] &&
+                      posting_offsets[term + 1] <= header().length[POSTING_BYTES], "posting offsets")) {
+            return PostingCursor();
+        }
+        return PostingCursor(posting_bytes + posting_offsets[term], posting_bytes + posting_offsets[term + 1],
+                             document_count());
+    }
+
+    // words in doc, counting repeats
+    uint32_t document_length(const int doc) const {
+        return section<uint32_t>(DOC_LENGTHS)[doc];
+    }
+
+    double average_document_length() const {
+        return average_length_value;
+    }
+
+    // occurrences of term in the doc at position ordinal of its posting list
+    int frequency(const int term, const int ordinal) const {
+        const size_t posting = posting_index(term, ordinal);
+        return posting == SIZE_MAX ? 0 : section<uint16_t>(FREQUENCIES)[posting];
+    }
+
+    // upper bound on bm25_weight() over every doc holding term
+    double weight_bound(const int term) const {
+        return in_range(term >= 0 && term < term_count(), "term bounds") ? section<float>(TERM_BOUNDS)[term] : 0;
+    }
+
+    // ascending word offsets of term in the doc at position ordinal of its posting list
+    void word_offsets(const int term, const int ordinal, vector<uint32_t> &offsets) const {
+        offsets.clear();
+        const size_t posting = posting_index(term, ordinal);
+        if (posting == SIZE_MAX) {
+            return;
+        }
+        const uint32_t *at = section<uint32_t>(POSITION_OFFSETS) + posting;
+        if (!in_range(at[0] <= at[1] && at[1] <= header().length[POSITION_BYTES], "position offsets")) {
+            return;
+        }
+        const uint8_t *in = section<uint8_t>(POSITION_BYTES) + at[0];
+        const uint8_t *stop = section<uint8_t>(POSITION_BYTES) + at[1];
+        uint32_t gap;
+        for (uint32_t previous = -1; in < stop && get_varint(in, stop, gap);) {
+            previous += gap + 1;
+            offsets.emplace_back(previous);
+        }
+    }
+
+    // docs in [begin, end) holding terms as a phrase, term i right after term i - 1
+    DocSet phrase(const vector<int> &terms, const int begin, const int end) const {
+        return positional(terms, begin, end, [](const vector<vector<uint32_t>> &offsets) {
+            for (const uint32_t start: offsets[0]) {
+                bool found = true;
+                for (size_t i = 1; i < offsets.size() && found; i++) {
+                    found = std::binary_search(offsets[i].begin(), offsets[i].end(), start + i);
+                }
+                if (found) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+
+    // docs in [begin, end) where the two terms occur within window words of each other
+    DocSet near(const vector<int> &terms, const int window, const int begin, const int end) const {
+        return positional(terms, begin, end, [window](const vector<vector<uint32_t>> &offsets) {
+            const vector<uint32_t> &a = offsets[0], &b = offsets[1];
+            for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+                if ((a[i] > b[j] ? a[i] - b[j] : b[j] - a[i]) <= (uint32_t) window) {
+                    return true;
+                }
+                a[i] < b[j] ? i++ : j++;
+            }
+            return false;
+        });
+    }
+
+    // term id of the exact word, -1 when the dictionary does not hold it
+    int find_term(const string &word) const {
+        return dictionary.find(word);
+    }
+
+    /**
+     * The docs that contain term (keep) or lack it. The term's posting list
+     * is decoded lazily: the cursor only touches the blocks that can hold
+     * one of docs, which pays off when docs is far shorter than the list.
+     */
+    DocSet filter(const DocSet &docs, const int term, const bool keep) const {
+        PostingCursor it = cursor(term);
+        vector<int> kept;
+        docs.for_each([&](const int doc) {
+            it.advance(doc);
+            if ((!it.done() && it.doc() == doc) == keep) {
+                kept.emplace_back(doc);
+            }
+        });
+        return DocSet(std::move(kept), document_count());
+    }
+
+    // (term, doc) pairs across the whole index
+    size_t posting_count() const {
+        return section<uint32_t>(FREQ_OFFSETS)[term_count()];
+    }
+
+    size_t image_bytes() const {
+        return header().size;
+    }
+
+    void memory_report(ostream &os) const {
+        os << "dictionary:     " << term_count() << " words, " << dictionary.state_count() << " states, "
+           << dictionary.edge_count() << " edges, " << dictionary.bytes() << " bytes" << endl;
+        os << "suffix order:   " << header().length[SUFFIX_ORDER] << " bytes" << endl;
+        // the forward and reverse tries the automaton and suffix order replaced: a trie has a
+        // node per distinct prefix, so each word adds the letters it does not share with the
+        // word before it, in sorted order and in reversed-word order respectively
+        size_t forward = 1, reverse = 1;
+        string_view previous;
+        for (int t = 0; t < term_count(); t++) {
+            const string_view word = term(t);
+            size_t common = 0;
+            while (common < word.size() && common < previous.size() && word[common] == previous[common]) {
+                common++;
+            }
+            forward += word.size() - common;
+            previous = word;
+        }
+        previous = {};
+        const uint32_t *order = section<uint32_t>(SUFFIX_ORDER);
+        for (int i = 0; i < term_count(); i++) {
+            const string_view word = term(order[i]);
+            size_t common = 0;
+            while (common < word.size() && common < previous.size() &&
+                   word[word.size() - 1 - common] == previous[previous.size() - 1 - common]) {
+                common++;
+            }
+            reverse += word.size() - common;
+            previous = word;
+        }
+        const size_t trie_nodes = forward + reverse;
+        // one edge into every node but the two roots
+        const size_t arena_bytes = trie_nodes * sizeof(Node) + (trie_nodes - 2) * sizeof(uint32_t);
+        const size_t automaton_bytes = dictionary.bytes() + header().length[SUFFIX_ORDER];
+        os << "two tries:      " << trie_nodes << " nodes (" << forward << " forward, " << reverse << " reverse), "
+           << arena_bytes << " bytes as arenas (" << (double) arena_bytes / trie_nodes << " bytes/node), "
+           << trie_nodes * sizeof(PointerNode) << " bytes as pointer nodes (" << sizeof(PointerNode)
+           << " bytes/node)" << endl;
+        os << "automaton:      " << automaton_bytes << " bytes with the suffix order, "
+           << 100.0 * automaton_bytes / arena_bytes << "% of the arena tries" << endl;
+        os << "suffix array:   " << header().length[TEXT_SUFFIXES] << " bytes over " << header().length[TERM_BYTES]
+           << " bytes of vocabulary" << endl;
+        const size_t entries = posting_count();
+        os << "postings:       " << entries << " entries, " << header().length[POSTING_BYTES]
+           << " bytes encoded, " << entries * sizeof(int32_t) << " bytes as int32" << endl;
+        os << "wildcard grams: " << header().length[GRAM_TERMS] / sizeof(uint32_t) << " entries, "
+           << header().length[GRAM_OFFSETS] + header().length[GRAM_TERMS] << " bytes" << endl;
+        os << "positions:      " << header().length[POSITION_OFFSETS] + header().length[POSITION_BYTES]
+           << " bytes" << endl;
+        os << "ranking data:   " << header().length[DOC_LENGTHS] + header().length[FREQ_OFFSETS] +
+                                     header().length[FREQUENCIES] + header().length[TERM_BOUNDS]
+           << " bytes (lengths, frequencies, weight bounds)" << endl;
+        os << "index image:    " << header().size << " bytes" << endl;
+    }
+
+private:
+    // build structures, emptied by freeze(); titles go straight into one
+    // pool, doc d spanning title_bytes[title_offsets[d], title_offsets[d + 1])
+    vector<uint32_t> title_offsets = {0};
+    string title_bytes;
+    TrieTree vocabulary;    // word to build term id; freeze() renumbers terms in word order
+    vector<string> terms;
+    vector<vector<int>> postings;
+    vector<vector<uint32_t>> frequencies; // parallel to postings
+    vector<vector<uint32_t>> positions;   // word offsets, frequencies[t][i] of them per posting
+    vector<uint32_t> doc_lengths;
+    size_t build_bytes = 0; // rough size of the above, which an external build keeps under its budget
+
+    Dawg dictionary;
+
+    // the frozen image: owned after freeze(), mapped after load()
+    vector<char> image;
+    unique_ptr<MappedFile> mapping;
+    const char *base = nullptr;
+    uint64_t current_generation = 0;
+    const uint32_t *posting_offsets = nullptr;
+    const uint8_t *posting_bytes = nullptr;
+    double average_length_value = 1.0;
+
+    const IndexHeader &header() const {
+        return *reinterpret_cast<const IndexHeader *>(base);
+    }
+
+    template<typename T>
+    const T *section(const IndexSection s) const {
+        return reinterpret_cast<const T *>(base + header().offset[s]);
+    }
+
+    void attach(const char *data) {
+        static atomic<uint64_t> generations{0};
+        current_generation = ++generations;
+        base = data;
+        const IndexHeader &h = header();
+        posting_offsets = section<uint32_t>(POSTING_OFFSETS);
+        posting_bytes = section<uint8_t>(POSTING_BYTES);
+        average_length_value = average_length(section<uint32_t>(DOC_LENGTHS), document_count());
+        dictionary.attach(section<DawgState>(DICTIONARY_STATES), h.length[DICTIONARY_STATES] / sizeof(DawgState),
+                          section<uint32_t>(DICTIONARY_EDGES), h.length[DICTIONARY_EDGES] / sizeof(uint32_t));
+    }
+
+    string_view slice(const IndexSection offsets, const IndexSection bytes, const int i) const {
+        const uint32_t *at = section<uint32_t>(offsets);
+        if (!in_range(i >= 0 && (size_t) i + 1 < header().length[offsets] / sizeof(uint32_t) && at[i] <= at[i + 1] &&
+                      at[i + 1] <= header().length[bytes], offsets == TITLE_OFFSETS ? "title offsets" : "term offsets")) {
+            return {};
+        }
+        return {section<char>(bytes) + at[i], at[i + 1] - at[i]};
+    }
+
+    // FREQUENCIES and POSITION_OFFSETS index of term's posting at ordinal, SIZE_MAX when out of range
+    size_t posting_index(const int term, const int ordinal) const {
+        const uint32_t *at = section<uint32_t>(FREQ_OFFSETS);
+        if (!in_range(term >= 0 && term < term_count() && ordinal >= 0 && at[term] <= at[term + 1] &&
+                      at[term + 1] <= posting_count() && (uint32_t) ordinal < at[term + 1] - at[term],
+                      "frequency offsets")) {
+            return SIZE_MAX;
+        }
+        return at[term] + ordinal;
+    }
+
+    // ok; when not, a lookup met an entry pointing outside its section, which only a
+    // damaged file holds, and it reads as empty instead. Warned about once.
+    static bool in_range(const bool ok, const char *table) {
+        static atomic<bool> warned{false};
+        if (!ok && !warned.exchange(true)) {
+            cerr << "Warning: the index has an entry out of range in its " << table
+                 << ", run index verify" << endl;
+        }
+        return ok;
+    }
+
+    /**
+     * The section sizes the counts imply, and the last entry of each offset
+     * table inside the section it points into: nullptr when they hold, else
+     * the first table that does not. Entries before the last are checked as
+     * lookups follow them.
+     */
+    static const char *check_tables(const char *data, const IndexHeader &h) {
+        auto entries = [&](const IndexSection s) {
+            return h.length[s] / sizeof(uint32_t);
+        };
+        auto last = [&](const IndexSection s) {
+            return entries(s) == 0 ? 0 : reinterpret_cast<const uint32_t *>(data + h.offset[s])[entries(s) - 1];
+        };
+        for (const IndexSection s: {TITLE_OFFSETS, TERM_OFFSETS, POSTING_OFFSETS, DICTIONARY_EDGES, SUFFIX_ORDER,
+                                    TEXT_SUFFIXES, GRAM_OFFSETS, GRAM_TERMS, DOC_LENGTHS, FREQ_OFFSETS, TERM_BOUNDS,
+                                    POSITION_OFFSETS}) {
+            if (h.length[s] % sizeof(uint32_t) != 0) {
+                return "a table has a partial entry";
+            }
+        }
+        if (entries(TITLE_OFFSETS) == 0 || entries(TITLE_OFFSETS) > (size_t) INT_MAX ||
+            last(TITLE_OFFSETS) > h.length[TITLE_BYTES] || entries(DOC_LENGTHS) != entries(TITLE_OFFSETS) - 1) {
+            return "title offsets";
+        }
+        const size_t terms = entries(TERM_OFFSETS) - 1;
+        if (entries(TERM_OFFSETS) == 0 || terms > (size_t) INT_MAX || last(TERM_OFFSETS) > h.length[TERM_BYTES] ||
+            entries(SUFFIX_ORDER) != terms || entries(TEXT_SUFFIXES) != h.length[TERM_BYTES]) {
+            return "term offsets";
+        }
+        if (entries(POSTING_OFFSETS) != terms + 1 || last(POSTING_OFFSETS) > h.length[POSTING_BYTES]) {
+            return "posting offsets";
+        }
+        const size_t postings = last(FREQ_OFFSETS);
+        if (entries(FREQ_OFFSETS) != terms + 1 || entries(TERM_BOUNDS) != terms ||
+            h.length[FREQUENCIES] != postings * sizeof(uint16_t)) {
+            return "frequency offsets";
+        }
+        if (entries(POSITION_OFFSETS) != postings + 1 || last(POSITION_OFFSETS) > h.length[POSITION_BYTES]) {
+            return "position offsets";
+        }
+        if (entries(GRAM_OFFSETS) != GRAM_COUNT + 1 || last(GRAM_OFFSETS) > entries(GRAM_TERMS)) {
+            return "wildcard gram offsets";
+        }
+        if (h.length[DICTIONARY_STATES] % sizeof(DawgState) != 0 || h.length[DICTIONARY_STATES] == 0 ||
+            reinterpret_cast<const DawgState *>(data + h.offset[DICTIONARY_STATES])->words != terms) {
+            return "dictionary";
+        }
+        return nullptr;
+    }
+
+    // doc ids of term within [begin, end)
+    void posting(const int term, const int begin, const int end, vector<int> &docs) const {
+        PostingCursor it = cursor(term);
+        for (it.advance(begin); !it.done() && it.doc() < end; it.next()) {
+            docs.emplace_back(it.doc());
+        }
+    }
+
+    /**
+     * Docs in [begin, end) holding every one of terms for which accept()
+     * holds on their word offsets. The cursors are intersected doc at a
+     * time, and offsets are only decoded for docs holding all the terms.
+     */
+    template<typename Accept>
+    DocSet positional(const vector<int> &terms, const int begin, const int end, Accept accept) const {
+        vector<int> found;
+        if (terms.empty()) {
+            return DocSet(std::move(found), document_count());
+        }
+        vector<PostingCursor> cursors;
+        for (const int term: terms) {
+            cursors.emplace_back(cursor(term));
+        }
+        vector<vector<uint32_t>> offsets(terms.size());
+        for (int doc = begin; doc < end;) {
+            bool aligned = true;
+            for (auto &it: cursors) {
+                it.advance(doc);
+                if (it.done()) {
+                    return DocSet(std::move(found), document_count());
+                }
+                if (it.doc() > doc) {
+                    doc = it.doc();
+                    aligned = false;
+                    break;
+                }
+            }
+            if (!aligned) {
+                continue;
+            }
+            for (size_t i = 0; i < terms.size(); i++) {
+                word_offsets(terms[i], cursors[i].ordinal(), offsets[i]);
+            }
+            if (accept(offsets)) {
+                found.emplace_back(doc);
+            }
+            doc++;
+        }
+        return DocSet(std::move(found), document_count());
+    }
+
+    /**
+     * Build term ids in sorted word order. Frozen term ids are ranks in this
+     * order, which the dictionary automaton computes instead of storing.
+     */
+    vector<uint32_t> sorted_terms() const {
+        vector<uint32_t> order(terms.size());
+        for (uint32_t t = 0; t < order.size(); t++) {
+            order[t] = t;
+        }
+        std::sort(order.begin(), order.end(), [&](const uint32_t a, const uint32_t b) { return terms[a] < terms[b]; });
+        return order;
+    }
+
+    // reorder a posting list absorbed out of order, with its counts and offsets
+    static void sort_postings(vector<int> &list, vector<uint32_t> &counts, vector<uint32_t> &offsets) {
+        vector<size_t> order(list.size()), starts(list.size());
+        for (size_t i = 0, at = 0; i < list.size(); at += counts[i], i++) {
+            order[i] = i;
+            starts[i] = at;
+        }
+        std::sort(order.begin(), order.end(), [&](const size_t a, const size_t b) { return list[a] < list[b]; });
+        vector<int> sorted_list;
+        vector<uint32_t> sorted_counts, sorted_offsets;
+        for (const size_t i: order) {
+            sorted_list.emplace_back(list[i]);
+            sorted_counts.emplace_back(counts[i]);
+            sorted_offsets.insert(sorted_offsets.end(), offsets.begin() + starts[i],
+                                  offsets.begin() + starts[i] + counts[i]);
+        }
+        list.swap(sorted_list);
+        counts.swap(sorted_counts);
+        offsets.swap(sorted_offsets);
+    }
+
+    // build term id of word, registering it on first sight
+    int intern(string_view word) {
+        const uint32_t node = vocabulary.insert(word);
+        int term = vocabulary.term(node);
+        if (term < 0) {
+            term = terms.size();
+            vocabulary.set_term(node, term);
+            string lower(word);
+            std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+            terms.emplace_back(lower);
+            postings.emplace_back();
+            frequencies.emplace_back();
+            positions.emplace_back();
+            // at most one trie node and edge per letter
+            build_bytes += sizeof(string) + word.size() + 3 * sizeof(vector<int>) +
+                           word.size() * (sizeof(Node) + sizeof(uint32_t));
+        }
+        return term;
+    }
+
+    // term ids of the words ending in suffix: a run of SUFFIX_ORDER, found by binary search
+    void match_suffix(const string &suffix, vector<int> &matched) const {
+        const uint32_t *order = section<uint32_t>(SUFFIX_ORDER);
+        const uint32_t *end = order + term_count();
+        const uint32_t *it = std::lower_bound(order, end, suffix, [&](const uint32_t t, const string &tail) {
+            const string_view word = term(t);
+            return std::lexicographical_compare(word.rbegin(), word.rend(), tail.rbegin(), tail.rend());
+        });
+        for (; it != end; it++) {
+            const string_view word = term(*it);
+            if (word.size() < suffix.size() || word.substr(word.size() - suffix.size()) != suffix) {
+                break;
+            }
+            matched.emplace_back(*it);
+        }
+    }
+
+    /**
+     * Term ids of the words containing part, ascending. Every occurrence of
+     * part in the vocabulary text starts a suffix that begins with part, and
+     * those suffixes sit together in TEXT_SUFFIXES, so two binary searches
+     * of O(|part| log n) find them all. Terms are stored back to back, so an
+     * occurrence running into the next word is dropped.
+     */
+    void match_substring(const string &part, vector<int> &matched) const {
+        const uint32_t *suffixes = section<uint32_t>(TEXT_SUFFIXES);
+        const uint32_t *end = suffixes + header().length[TEXT_SUFFIXES] / sizeof(uint32_t);
+        const uint32_t *offsets = section<uint32_t>(TERM_OFFSETS);
+        const string_view text(section<char>(TERM_BYTES), header().length[TERM_BYTES]);
+        // a suffix past the text, as only a damaged index holds, sorts last
+        auto compare = [&](const uint32_t at, const string &key) {
+            return at <= text.size() ? text.compare(at, key.size(), key) : 1;
+        };
+        const uint32_t *first = std::lower_bound(suffixes, end, part, [&](const uint32_t at, const string &key) {
+            return compare(at, key) < 0;
+        });
+        const uint32_t *last = std::upper_bound(first, end, part, [&](const string &key, const uint32_t at) {
+            return compare(at, key) > 0;
+        });
+        const size_t before = matched.size();
+        for (const uint32_t *it = first; it != last; it++) {
+            const int t = std::upper_bound(offsets, offsets + term_count() + 1, *it) - offsets - 1;
+            if (t < term_count() && *it + part.size() <= offsets[t + 1]) {
+                matched.emplace_back(t);
+            }
+        }
+        std::sort(matched.begin() + before, matched.end());
+        matched.erase(std::unique(matched.begin() + before, matched.end()), matched.end());
+    }
+
+    /**
+     * Term ids matching a wildcard pattern, ascending. Candidates come from
+     * the rarest bigram's term list, narrowed by the others with a forward
+     * binary search each; a pattern without bigrams (such as *a*) falls back
+     * to scanning the vocabulary. Survivors are checked against the pattern,
+     * since bigrams ignore order and spacing.
+     */
+    void match_wildcard(const string &pattern, vector<int> &matched) const {
+        vector<int> grams;
+        if (!pattern_grams(pattern, grams)) {
+            return;
+        }
+        const uint32_t *offsets = section<uint32_t>(GRAM_OFFSETS);
+        const uint32_t *lists = section<uint32_t>(GRAM_TERMS);
+        std::sort(grams.begin(), grams.end(), [&](const int a, const int b) {
+            return offsets[a + 1] - offsets[a] < offsets[b + 1] - offsets[b];
+        });
+        auto accept = [&](const int t) {
+            if (wildcard_match(term(t), pattern)) {
+                matched.emplace_back(t);
+            }
+        };
+        if (grams.empty()) {
+            for (int t = 0; t < term_count(); t++) {
+                accept(t);
+            }
+            return;
+        }
+        vector<const uint32_t *> from(grams.size()), to(grams.size());
+        for (size_t g = 0; g < grams.size(); g++) {
+            if (!in_range(offsets[grams[g]] <= offsets[grams[g] + 1] &&
+                          offsets[grams[g] + 1] <= header().length[GRAM_TERMS] / sizeof(uint32_t), "gram offsets")) {
+                return;
+            }
+            from[g] = lists + offsets[grams[g]];
+            to[g] = lists + offsets[grams[g] + 1];
+        }
+        for (const uint32_t *it = from[0]; it != to[0]; it++) {
+            bool found = true;
+            for (size_t g = 1; g < grams.size() && found; g++) {
+                from[g] = std::lower_bound(from[g], to[g], *it);
+                found = from[g] != to[g] && *from[g] == *it;
+            }
+            if (found) {
+                accept(*it);
+            }
+        }
+    }
+
+    vector<int> merge_postings(const vector<int> &matched, const int begin = 0, const int end = INT_MAX) const {
+        vector<int> docs;
+        for (const int term: matched) {
+            posting(term, begin, end, docs);
+        }
+        if (matched.size() == 1) {
+            return docs;
+        }
+        std::sort(docs.begin(), docs.end());
+        docs.erase(std::unique(docs.begin(), docs.end()), docs.end());
+        return docs;
+    }
+};
+
+
+// Utility Func
+
+// string parser : output vector of strings (words) after parsing
+vector<string> word_parse(vector<string> tmp_string) {
+    vector<string> parse_string;
+    for (auto &word: tmp_string) {
+        string new_str;
+        for (auto &ch: word) {
+            if (isalpha(ch))
+                new_str.push_back(ch);
+        }
+        parse_string.emplace_back(new_str);
+    }
+    return parse_string;
+}
+
+vector<string> split(const string &str, const string &delim) {
+    vector<string> res;
+    if ("" == str) return res;
+
+    char *strs = new char[str.length() + 1];
+    strcpy(strs, str.c_str());
+
+    char *d = new char[delim.length() + 1];
+    strcpy(d, delim.c_str());
+
+    // strtok_r: ingestion workers split lines concurrently
+    char *context = nullptr;
+    char *p = strtok_r(strs, d, &context);
+    while (p) {
+        string s = p;
+        res.push_back(s);
+        p = strtok_r(NULL, d, &context);
+    }
+
+    delete[] strs;
+    delete[] d;
+
+    return res;
+}
+
+/**
+ * Byte classes of a 64-byte block, one bit per byte, as produced by the
+ * tokenizer kernels below.
+ */
+struct ByteClasses {
+    uint64_t delim;  // ' ' or '\n'
+    uint64_t letter; // A-Z or a-z
+    uint64_t lower;  // a-z
+    char folded[64]; // the block with every letter lowercased
+};
+
+typedef void (*ClassifyKernel)(const char *block, ByteClasses &classes);
+
+void classify_scalar(const char *block, ByteClasses &classes) {
+    uint64_t delim = 0, letter = 0, lower = 0;
+    for (int i = 0; i < 64; i++) {
+        const unsigned char c = block[i];
+        const unsigned char f = c | 0x20;
+        const bool is_letter = f >= 'a' && f <= 'z';
+        delim |= (uint64_t) (c == ' ' || c == '\n') << i;
+        letter |= (uint64_t) is_letter << i;
+        lower |= (uint64_t) (c >= 'a' && c <= 'z') << i;
+        classes.folded[i] = is_letter ? f : c;
+    }
+    classes.delim = delim;
+    classes.letter = letter;
+    classes.lower = lower;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Lowercase-range tests bias the bytes so 'a' lands on -128; then one signed
+// compare against -128 + 26 picks out ['a', 'z'].
+
+__attribute__((target("sse2")))
+void classify_sse2(const char *block, ByteClasses &classes) {
+    const __m128i bias = _mm_set1_epi8((char) (0x80 - 'a'));
+    const __m128i bound = _mm_set1_epi8(-128 + 26);
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    uint64_t delim = 0, letter = 0, lower = 0;
+    for (int i = 0; i < 64; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + i));
+        const __m128i d = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                       _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        const __m128i l = _mm_cmplt_epi8(_mm_add_epi8(v, bias), bound);
+        const __m128i a = _mm_cmplt_epi8(_mm_add_epi8(_mm_or_si128(v, case_bit), bias), bound);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(classes.folded + i),
+                         _mm_or_si128(v, _mm_and_si128(a, case_bit)));
+        delim |= (uint64_t) (uint16_t) _mm_movemask_epi8(d) << i;
+        lower |= (uint64_t) (uint16_t) _mm_movemask_epi8(l) << i;
+        letter |= (uint64_t) (uint16_t) _mm_movemask_epi8(a) << i;
+    }
+    classes.delim = delim;
+    classes.letter = letter;
+    classes.lower = lower;
+}
+
+__attribute__((target("avx2")))
+void classify_avx2(const char *block, ByteClasses &classes) {
+    const __m256i bias = _mm256_set1_epi8((char) (0x80 - 'a'));
+    const __m256i bound = _mm256_set1_epi8(-128 + 26);
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    uint64_t delim = 0, letter = 0, lower = 0;
+    for (int i = 0; i < 64; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block + i));
+        const __m256i d = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                          _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        const __m256i l = _mm256_cmpgt_epi8(bound, _mm256_add_epi8(v, bias));
+        const __m256i a = _mm256_cmpgt_epi8(bound, _mm256_add_epi8(_mm256_or_si256(v, case_bit), bias));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(classes.folded + i),
+                            _mm256_or_si256(v, _mm256_and_si256(a, case_bit)));
+        delim |= (uint64_t) (uint32_t) _mm256_movemask_epi8(d) << i;
+        lower |= (uint64_t) (uint32_t) _mm256_movemask_epi8(l) << i;
+        letter |= (uint64_t) (uint32_t) _mm256_movemask_epi8(a) << i;
+    }
+    classes.delim = delim;
+    classes.letter = letter;
+    classes.lower = lower;
+}
+#endif
+
+// widest kernel the running CPU supports
+ClassifyKernel best_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const ClassifyKernel kernel = []() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return classify_avx2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return classify_sse2;
+        }
+        return classify_scalar;
+    }();
+    return kernel;
+#else
+    return classify_scalar;
+#endif
+}
+
+/**
+ * Streams the words of an essay straight off its bytes. A word is a
+ * space-separated run within a line with every non-letter dropped and the
+ * letters lowercased, the same words split() + word_parse() produce.
+ *
+ * Bytes are classified 64 at a time by a kernel, and word boundaries come
+ * from the delimiter bitmask. Words that are already lowercase letters are
+ * returned as views into the input; the rest are gathered from the folded
+ * block into one scratch buffer reused for every word.
+ */
+class Tokenizer {
+    const char *current;
+    const char *end;
+    const char *base = nullptr; // start of the classified block
+    ClassifyKernel kernel;
+    ByteClasses classes{};
+    string scratch;
+
+public:
+    Tokenizer(const char *begin, const char *end, ClassifyKernel kernel = best_kernel())
+        : current(begin), end(end), kernel(kernel) {
+    }
+
+    // the rest of the current line without its newline, not consumed
+    string_view peek_line() const {
+        const char *stop = current;
+        while (stop < end && *stop != '\n') {
+            stop++;
+        }
+        return {current, (size_t) (stop - current)};
+    }
+
+    // next non-empty word, false once the input is exhausted
+    bool next(string_view &word) {
+        while (true) {
+            // skip delimiters
+            while (true) {
+                if (current >= end) {
+                    return false;
+                }
+                const int offset = window();
+                const uint64_t text = ~classes.delim >> offset;
+                if (text != 0) {
+                    current += __builtin_ctzll(text);
+                    break;
+                }
+                current += 64 - offset;
+            }
+            // find the end of the word, gathering letters once it turns out dirty
+            const char *start = current;
+            bool dirty = false;
+            while (current < end) {
+                const int offset = window();
+                const uint64_t delim = classes.delim >> offset;
+                const int run = delim != 0 ? __builtin_ctzll(delim) : 64 - offset;
+                const uint64_t span = run == 64 ? ~0ull : (1ull << run) - 1;
+                if (!dirty && (~classes.lower >> offset & span) != 0) {
+                    dirty = true;
+                    scratch.assign(start, current);
+                }
+                if (dirty) {
+                    for (uint64_t bits = classes.letter >> offset & span; bits != 0; bits &= bits - 1) {
+                        scratch.push_back(classes.folded[offset + __builtin_ctzll(bits)]);
+                    }
+                }
+                current += run;
+                if (delim != 0) {
+                    break;
+                }
+            }
+            if (!dirty) {
+                word = string_view(start, current - start);
+                return true;
+            }
+            if (!scratch.empty()) {
+                word = scratch;
+                return true;
+            }
+        }
+    }
+
+private:
+    // classify the block holding current if needed, returning current's bit offset
+    int window() {
+        if (base == nullptr || current >= base + 64) {
+            base = current;
+            if (end - current >= 64) {
+                kernel(current, classes);
+            } else {
+                // pad the tail with delimiters so every word ends inside it
+                char tail[64];
+                memset(tail, ' ', sizeof(tail));
+                memcpy(tail, current, end - current);
+                kernel(tail, classes);
+            }
+        }
+        return current - base;
+    }
+};
+
+vector<string> parse_query(const string &query_file) {
+    vector<string> queries;
+    string line;
+    fstream fi;
+    fi.open(query_file.c_str(), ios::in);
+    while (getline(fi, line)) {
+        queries.emplace_back(line);
+    }
+    fi.close();
+    return queries;
+}
+
+// bytes of output collected before they are written out in one go
+const size_t WRITE_BUFFER = 1 << 20;
+
+/**
+ * Sink for result lines. Lines pile up in one buffer which is written out
+ * whenever it passes WRITE_BUFFER, so a run costs a handful of large writes
+ * rather than a flush per line. With echo the same bytes are copied to
+ * stdout as well.
+ */
+class ResultWriter {
+public:
+    ResultWriter(const string &file_name, const bool echo)
+        : file(file_name, ios::out | ios::binary), out(&file), echo(echo) {
+        buffer.reserve(WRITE_BUFFER);
+    }
+
+    // write to a stream that is already open, such as cout
+    explicit ResultWriter(ostream &os) : out(&os), echo(false) {
+        buffer.reserve(WRITE_BUFFER);
+    }
+
+    ~ResultWriter() {
+        flush();
+    }
+
+    bool is_open() const {
+        return out != &file || file.is_open();
+    }
+
+    void line(string_view text) {
+        buffer.append(text.data(), text.size());
+        buffer += '\n';
+        if (buffer.size() >= WRITE_BUFFER) {
+            flush();
+        }
+    }
+
+    // the titles of docs in order, or "Not Found!" when there are none
+    template<typename Index>
+    void answer(const Index &index, const vector<int> &docs) {
+        if (docs.empty()) {
+            line("Not Found!");
+        }
+        for (const int doc: docs) {
+            line(index.title(doc));
+        }
+    }
+
+    // write out whatever is buffered; false once a write has failed
+    bool flush() {
+        if (!buffer.empty()) {
+            out->write(buffer.data(), buffer.size());
+            if (echo) {
+                cout.write(buffer.data(), buffer.size());
+            }
+            buffer.clear();
+        }
+        out->flush();
+        if (echo) {
+            cout.flush();
+        }
+        return out->good();
+    }
+
+private:
+    ofstream file;
+    ostream *out;
+    bool echo;
+    string buffer;
+};
+
+/**
+ * Query language, one query per line:
+ *
+ *   query    := term (operator term)*   operators are left associative
+ *   operator := '+' and | '/' or | '-' exclude
+ *   term     := word NEAR/k word | word
+ *   word     := "word" exact | "some words" phrase | *word* suffix | <pat*tern> wildcard
+ *             | {part} substring | word prefix | word~k or "word"~k fuzzy, within k edits
+ *
+ * QueryParser turns a line into a QueryNode tree; for the grammar above the
+ * tree is a left spine, ((A op B) op C) op D.
+ */
+struct QueryTerm {
+    int kind = PREFIX; // EXACT, PREFIX, SUFFIX, INFIX (wildcard), PHRASE, NEAR, FUZZY or SUBSTRING
+    string text;       // lowercased, without quotes, stars or brackets; words split by one space; FUZZY keeps its ~k
+    int window = 0;    // NEAR only: the most words apart the two may be
+};
+
+struct QueryNode {
+    char op = 0; // 0 for a leaf holding term
+    QueryTerm term;
+    unique_ptr<QueryNode> left;
+    unique_ptr<QueryNode> right;
+};
+
+class QueryParser {
+    string_view text;
+    size_t at = 0;
+    string error;
+
+public:
+    explicit QueryParser(string_view text): text(text) {
+    }
+
+    // the parsed query, or nullptr with the reason in error
+    unique_ptr<QueryNode> parse(string &reason) {
+        unique_ptr<QueryNode> tree = parse_term();
+        while (tree != nullptr && skip_spaces()) {
+            const char op = text[at];
+            if (op != OP_AND && op != OP_OR && op != OP_EXCLUDE) {
+                fail(string("expected an operator, found '") + op + "'");
+                break;
+            }
+            at++;
+            unique_ptr<QueryNode> right = parse_term();
+            if (right == nullptr) {
+                break;
+            }
+            auto node = make_unique<QueryNode>();
+            node->op = op;
+            node->left = std::move(tree);
+            node->right = std::move(right);
+            tree = std::move(node);
+        }
+        if (!error.empty()) {
+            reason = error;
+            return nullptr;
+        }
+        return tree;
+    }
+
+private:
+    // move to the next non-space character, false at the end of the line
+    bool skip_spaces() {
+        while (at < text.size() && isspace((unsigned char) text[at])) {
+            at++;
+        }
+        return at < text.size();
+    }
+
+    void fail(const string &reason) {
+        if (error.empty()) {
+            error = reason + " at column " + to_string(at + 1);
+        }
+    }
+
+    // characters up to the closing delimiter, which is consumed
+    bool read_until(const char close, string &out) {
+        const size_t start = at;
+        while (at < text.size() && text[at] != close) {
+            at++;
+        }
+        if (at == text.size()) {
+            at = start;
+            fail(string("missing closing '") + close + "'");
+            return false;
+        }
+        out.assign(text.substr(start, at - start));
+        at++;
+        return true;
+    }
+
+    // a term, or two words joined by NEAR/k (case-insensitive)
+    unique_ptr<QueryNode> parse_term() {
+        unique_ptr<QueryNode> leaf = parse_word();
+        const string_view keyword = "near/";
+        if (leaf == nullptr || !skip_spaces() || text.size() - at < keyword.size()) {
+            return leaf;
+        }
+        for (size_t i = 0; i < keyword.size(); i++) {
+            if (tolower((unsigned char) text[at + i]) != keyword[i]) {
+                return leaf;
+            }
+        }
+        at += keyword.size();
+        const size_t digits = at;
+        while (at < text.size() && isdigit((unsigned char) text[at])) {
+            at++;
+        }
+        if (at == digits || at - digits > 6) {
+            fail("NEAR needs a distance, as in NEAR/3");
+            return nullptr;
+        }
+        const int window = stoi(string(text.substr(digits, at - digits)));
+        const unique_ptr<QueryNode> right = parse_word();
+        if (right == nullptr) {
+            return nullptr;
+        }
+        for (const QueryNode *side: {leaf.get(), right.get()}) {
+            if ((side->term.kind != PREFIX && side->term.kind != EXACT) ||
+                side->term.text.find(' ') != string::npos) {
+                fail("NEAR joins two plain words");
+                return nullptr;
+            }
+        }
+        leaf->term.kind = NEAR;
+        leaf->term.text += " " + right->term.text;
+        leaf->term.window = window;
+        return leaf;
+    }
+
+    // the ~k after a single word, which turns it into a fuzzy term
+    bool parse_edits(QueryTerm &term) {
+        if (term.kind != PREFIX && term.kind != EXACT) {
+            fail("only a single word can be fuzzy, as in graph~1");
+            return false;
+        }
+        at++;
+        if (at == text.size() || !isdigit((unsigned char) text[at]) || text[at] - '0' > MAX_FUZZY_EDITS) {
+            fail("~ needs an edit distance from 0 to " + to_string(MAX_FUZZY_EDITS));
+            return false;
+        }
+        term.kind = FUZZY;
+        term.text += text.substr(at - 1, 2);
+        at++;
+        return true;
+    }
+
+    unique_ptr<QueryNode> parse_word() {
+        if (!skip_spaces()) {
+            fail("expected a term");
+            return nullptr;
+        }
+        auto leaf = make_unique<QueryNode>();
+        QueryTerm &term = leaf->term;
+        const char open = text[at];
+        if (open == '"') {
+            at++;
+            term.kind = EXACT;
+            string quoted;
+            if (!read_until('"', quoted)) {
+                return nullptr;
+            }
+            // words are cut and stripped the way the tokenizer does it
+            istringstream words(quoted);
+            for (string word; words >> word;) {
+                word.erase(std::remove_if(word.begin(), word.end(), [](const char c) { return !isalpha((unsigned char) c); }),
+                           word.end());
+                if (!word.empty()) {
+                    term.text += term.text.empty() ? word : " " + word;
+                }
+            }
+            if (term.text.find(' ') != string::npos) {
+                term.kind = PHRASE;
+            } else if (term.text.empty()) {
+                term.text = quoted;
+            }
+        } else if (open == '*') {
+            at++;
+            term.kind = SUFFIX;
+            if (!read_until('*', term.text)) {
+                return nullptr;
+            }
+        } else if (open == '<') {
+            at++;
+            term.kind = INFIX;
+            if (!read_until('>', term.text)) {
+                return nullptr;
+            }
+        } else if (open == '{') {
+            at++;
+            term.kind = SUBSTRING;
+            if (!read_until('}', term.text)) {
+                return nullptr;
+            }
+        } else if (open == OP_AND || open == OP_OR || open == OP_EXCLUDE) {
+            fail(string("expected a term, found '") + open + "'");
+            return nullptr;
+        } else {
+            const size_t start = at;
+            while (at < text.size() && !isspace((unsigned char) text[at]) && text[at] != OP_AND &&
+                   text[at] != OP_OR && text[at] != OP_EXCLUDE && text[at] != '~') {
+                at++;
+            }
+            term.kind = PREFIX;
+            term.text.assign(text.substr(start, at - start));
+        }
+        if (term.text.empty()) {
+            fail("empty term");
+            return nullptr;
+        }
+        if (at < text.size() && text[at] == '~' && !parse_edits(term)) {
+            return nullptr;
+        }
+        std::transform(term.text.begin(), term.text.end(), term.text.begin(), ::tolower);
+        return leaf;
+    }
+};
+
+/**
+ * A query compiled against an index: the terms in evaluation order, each
+ * already resolved to the dictionary terms it matches. The first step loads
+ * the initial doc set, every later one folds its op into it.
+ */
+struct PlanStep {
+    char op = 0;
+    QueryTerm term;
+    vector<int> terms;    // matching dictionary term ids
+    size_t estimate = 0;  // upper bound on the docs the term matches
+};
+
+struct QueryPlan {
+    vector<PlanStep> steps;
+};
+
+/**
+ * Flatten the left spine into steps, resolve every term, then reorder
+ * within runs where order cannot change the result: a run of ANDs
+ * (including the leading term when the run starts the query) is evaluated
+ * smallest first, so the candidate set shrinks early and stays cheap to
+ * probe; a run of excludes goes largest first for the same reason. ORs and
+ * the boundaries between different operators keep their order, which is
+ * what left associativity requires.
+ */
+QueryPlan compile_query(const InvertedIndex &index, const QueryNode &tree) {
+    QueryPlan plan;
+    const QueryNode *node = &tree;
+    while (node->op != 0) {
+        PlanStep step;
+        step.op = node->op;
+        step.term = node->right->term;
+        plan.steps.emplace_back(std::move(step));
+        node = node->left.get();
+    }
+    PlanStep first;
+    first.term = node->term;
+    plan.steps.emplace_back(std::move(first));
+    std::reverse(plan.steps.begin(), plan.steps.end());
+
+    for (auto &step: plan.steps) {
+        step.terms = index.resolve(step.term.text, step.term.kind);
+        const bool all_words = step.term.kind == PHRASE || step.term.kind == NEAR;
+        for (const int term: step.terms) {
+            const size_t frequency = index.document_frequency(term);
+            step.estimate = all_words && step.estimate > 0 ? std::min(step.estimate, frequency)
+                                                           : step.estimate + frequency;
+        }
+        step.estimate = std::min(step.estimate, (size_t) index.document_count());
+    }
+
+    auto &steps = plan.steps;
+    for (size_t begin = 1; begin < steps.size();) {
+        size_t end = begin;
+        while (end < steps.size() && steps[end].op == steps[begin].op) {
+            end++;
+        }
+        const char op = steps[begin].op;
+        // a leading run of ANDs may pull the first term in with it
+        const size_t from = begin == 1 && op == OP_AND ? 0 : begin;
+        if (op == OP_AND) {
+            std::stable_sort(steps.begin() + from, steps.begin() + end, [](const PlanStep &a, const PlanStep &b) {
+                return a.estimate < b.estimate;
+            });
+        } else if (op == OP_EXCLUDE) {
+            std::stable_sort(steps.begin() + from, steps.begin() + end, [](const PlanStep &a, const PlanStep &b) {
+                return a.estimate > b.estimate;
+            });
+        }
+        if (from == 0) {
+            steps[0].op = 0;
+            for (size_t i = 1; i < end; i++) {
+                steps[i].op = OP_AND;
+            }
+        }
+        begin = end;
+    }
+    return plan;
+}
+
+// docs in [begin, end) that step's term matches
+DocSet step_docs(const InvertedIndex &index, const PlanStep &step, const int begin, const int end) {
+    if (step.term.kind == PHRASE) {
+        return index.phrase(step.terms, begin, end);
+    }
+    if (step.term.kind == NEAR) {
+        return index.near(step.terms, step.term.window, begin, end);
+    }
+    return index.docs(step.terms, begin, end);
+}
+
+// fold one plan step into docs, all of which lie in [begin, end)
+DocSet apply_step(const InvertedIndex &index, const DocSet &docs, const PlanStep &step,
+                  const int begin, const int end) {
+    const char op = step.op;
+    if (docs.empty() && op != OP_OR) {
+        return docs;
+    }
+    if (step.term.kind == EXACT && op != OP_OR) {
+        if (step.terms.empty()) {
+            return op == OP_AND ? DocSet({}, index.document_count()) : docs;
+        }
+        // few candidates against a long list: probe the compressed list instead of decoding it
+        if (!docs.dense() && docs.size() * GALLOP_RATIO < step.estimate) {
+            return index.filter(docs, step.terms.front(), op == OP_AND);
+        }
+    }
+    const DocSet other = step_docs(index, step, begin, end);
+    if (op == OP_AND) {
+        return intersect(docs, other);
+    }
+    if (op == OP_OR) {
+        return unite(docs, other);
+    }
+    // OP_EXCLUDE CASE
+    return subtract(docs, other);
+}
+
+/**
+ * The docs of plan with ids in [begin, end). Every operator decides each
+ * doc on its own, so evaluating disjoint ranges and concatenating them
+ * gives the same answer as one pass over the whole corpus.
+ */
+DocSet evaluate(const InvertedIndex &index, const QueryPlan &plan, const int begin, const int end) {
+    DocSet docs = step_docs(index, plan.steps.front(), begin, end);
+    for (size_t i = 1; i < plan.steps.size(); i++) {
+        docs = apply_step(index, docs, plan.steps[i], begin, end);
+    }
+    return docs;
+}
+
+DocSet evaluate(const InvertedIndex &index, const QueryPlan &plan) {
+    return evaluate(index, plan, 0, index.document_count());
+}
+
+// query text with case folded, whitespace runs collapsed to one space and trimmed
+string normalize_query(const string &query) {
+    string key;
+    for (const char ch: query) {
+        if (isspace((unsigned char) ch)) {
+            if (!key.empty() && key.back() != ' ') {
+                key.push_back(' ');
+            }
+        } else {
+            key.push_back(tolower((unsigned char) ch));
+        }
+    }
+    if (!key.empty() && key.back() == ' ') {
+        key.pop_back();
+    }
+    return key;
+}
+
+struct CachedQuery {
+    uint64_t generation = 0; // index generation the plan was compiled against
+    QueryPlan plan;
+    bool has_result = false;
+    vector<int> result;
+};
+
+/**
+ * Bounded LRU of compiled queries keyed by normalized query text. Each
+ * entry remembers the index generation it was compiled against and is
+ * dropped the first time it is looked up under a different one. With
+ * store_results the final doc ids are cached too, so a repeated query
+ * skips evaluation as well as parsing and dictionary lookups.
+ */
+class QueryCache {
+    typedef list<pair<string, shared_ptr<const CachedQuery>>> Order;
+
+    size_t capacity;
+    bool store_results;
+    mutable mutex lock;
+    Order order; // most recently used first
+    unordered_map<string, Order::iterator> entries;
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t invalidations = 0;
+
+public:
+    QueryCache(const size_t capacity, const bool store_results)
+        : capacity(std::max<size_t>(1, capacity)), store_results(store_results) {
+    }
+
+    bool caches_results() const {
+        return store_results;
+    }
+
+    shared_ptr<const CachedQuery> find(const string &key, const uint64_t generation) {
+        lock_guard<mutex> guard(lock);
+        const auto found = entries.find(key);
+        if (found == entries.end()) {
+            misses++;
+            return nullptr;
+        }
+        if (found->second->second->generation != generation) {
+            order.erase(found->second);
+            entries.erase(found);
+            invalidations++;
+            misses++;
+            return nullptr;
+        }
+        order.splice(order.begin(), order, found->second);
+        hits++;
+        return found->second->second;
+    }
+
+    void insert(const string &key, shared_ptr<const CachedQuery> entry) {
+        lock_guard<mutex> guard(lock);
+        const auto found = entries.find(key);
+        if (found != entries.end()) {
+            order.erase(found->second);
+            entries.erase(found);
+        }
+        order.emplace_front(key, std::move(entry));
+        entries[key] = order.begin();
+        while (entries.size() > capacity) {
+            entries.erase(order.back().first);
+            order.pop_back();
+            evictions++;
+        }
+    }
+
+    void report(ostream &os) const {
+        lock_guard<mutex> guard(lock);
+        os << "query cache: " << hits << " hits, " << misses << " misses, " << evictions
+           << " evictions, " << invalidations << " invalidations, " << entries.size() << "/"
+           << capacity << " entries" << endl;
+    }
+};
+
+/**
+ * Parse and compile one query line, through cache when there is one. Null
+ * for a blank line, which produces no output; a malformed query is
+ * reported on stderr and comes back as an empty result.
+ */
+shared_ptr<const CachedQuery> prepare_query(const InvertedIndex &index, const string &query, QueryCache *cache) {
+    const string key = normalize_query(query);
+    if (key.empty()) {
+        return nullptr;
+    }
+    if (cache != nullptr) {
+        shared_ptr<const CachedQuery> hit = cache->find(key, index.generation());
+        if (hit != nullptr) {
+            return hit;
+        }
+    }
+    string error;
+    const unique_ptr<QueryNode> tree = QueryParser(query).parse(error);
+    if (tree == nullptr) {
+        cerr << "Invalid query \"" << query << "\": " << error << endl;
+        auto invalid = make_shared<CachedQuery>();
+        invalid->has_result = true;
+        return invalid;
+    }
+    auto compiled = make_shared<CachedQuery>();
+    compiled->generation = index.generation();
+    compiled->plan = compile_query(index, *tree);
+    if (cache != nullptr) {
+        // results, when cached, replace this entry once they are known
+        cache->insert(key, compiled);
+    }
+    return compiled;
+}
+
+// cache query's plan together with its evaluated docs
+void remember_result(QueryCache &cache, const string &query, const CachedQuery &entry, vector<int> docs) {
+    auto stored = make_shared<CachedQuery>();
+    stored->generation = entry.generation;
+    stored->plan = entry.plan;
+    stored->has_result = true;
+    stored->result = std::move(docs);
+    cache.insert(normalize_query(query), std::move(stored));
+}
+
+// answer one query line; false for a blank line
+bool run_query(const InvertedIndex &index, const string &query, QueryCache *cache, DocSet &docs) {
+    const shared_ptr<const CachedQuery> entry = prepare_query(index, query, cache);
+    if (entry == nullptr) {
+        return false;
+    }
+    if (entry->has_result) {
+        docs = DocSet(entry->result, index.document_count());
+        return true;
+    }
+    docs = evaluate(index, entry->plan);
+    if (cache != nullptr && cache->caches_results()) {
+        remember_result(*cache, query, *entry, docs.to_vector());
+    }
+    return true;
+}
+
+/**
+ * Fixed set of workers, each with its own deque of tasks. A worker takes
+ * from the back of its own deque, so the pieces it just split off run
+ * while their data is still warm, and when that runs dry it steals from
+ * the front of the others, where the oldest and largest tasks wait. Tasks
+ * may spawn more tasks; run() returns once all of them have finished.
+ */
+class WorkStealingPool {
+public:
+    typedef function<void(int worker)> Task;
+
+    explicit WorkStealingPool(const int threads) : queues(std::max(1, threads)) {
+    }
+
+    int size() const {
+        return queues.size();
+    }
+
+    // queue task on worker's deque; safe before run() and from inside a task
+    void spawn(const int worker, Task task) {
+        pending++;
+        {
+            lock_guard<mutex> guard(queues[worker].lock);
+            queues[worker].tasks.emplace_back(std::move(task));
+        }
+        queued++;
+        lock_guard<mutex> guard(idle_lock);
+        idle.notify_one();
+    }
+
+    void run() {
+        vector<thread> workers;
+        for (int w = 1; w < size(); w++) {
+            workers.emplace_back([this, w]() { work(w); });
+        }
+        work(0);
+        for (auto &worker: workers) {
+            worker.join();
+        }
+    }
+
+private:
+    struct Queue {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    vector<Queue> queues;
+    atomic<size_t> pending{0}; // spawned but not yet finished
+    atomic<size_t> queued{0};  // spawned but not yet taken
+    mutex idle_lock;
+    condition_variable idle;   // workers with nothing to take park here
+
+    bool take(const int worker, Task &task) {
+        for (int i = 0; i < size(); i++) {
+            Queue &queue = queues[(worker + i) % size()];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void work(const int worker) {
+        Task task;
+        while (pending > 0) {
+            if (take(worker, task)) {
+                task(worker);
+                // children are counted before their parent finishes, so
+                // pending only reaches zero when everything is done
+                if (--pending == 0) {
+                    lock_guard<mutex> guard(idle_lock);
+                    idle.notify_all();
+                }
+            } else {
+                unique_lock<mutex> guard(idle_lock);
+                idle.wait(guard, [this]() { return queued > 0 || pending == 0; });
+            }
+        }
+    }
+};
+
+// postings a plan walks past the first one before it is worth splitting
+const size_t QUERY_SPLIT_COST = 1 << 16;
+
+// rough work to evaluate plan: postings to decode plus a cursor per term
+size_t plan_cost(const QueryPlan &plan) {
+    size_t cost = 0;
+    for (auto &step: plan.steps) {
+        cost += step.estimate + step.terms.size();
+    }
+    return cost;
+}
+
+/**
+ * Answer a batch of queries on a work-stealing pool, one task per line.
+ * A costly line (broad wildcards, short prefixes) is cut into doc id
+ * ranges evaluated as separate tasks, so one slow query cannot hold up a
+ * worker while the others sit idle. Each finished line is streamed to
+ * writer as soon as every line before it has been written.
+ */
+void start_query_parallel(const InvertedIndex &index, vector<string> &query_strings, ResultWriter &writer,
+                          QueryCache *cache, const int threads) {
+    struct Answer {
+        shared_ptr<const CachedQuery> entry;
+        vector<vector<int>> parts; // docs of each doc id range, in range order
+        atomic<int> remaining{0};  // ranges still being evaluated
+        bool finished = false;
+    };
+    const int documents = index.document_count();
+    vector<Answer> answers(query_strings.size());
+    mutex emit_lock;
+    size_t next = 0; // first line not yet written
+
+    auto emit = [&](const size_t q) {
+        Answer &answer = answers[q];
+        if (answer.entry == nullptr) {
+            return;
+        }
+        vector<int> docs = answer.entry->result;
+        for (auto &part: answer.parts) {
+            docs.insert(docs.end(), part.begin(), part.end());
+        }
+        writer.answer(index, docs);
+        if (cache != nullptr && cache->caches_results() && !answer.entry->has_result) {
+            remember_result(*cache, query_strings[q], *answer.entry, std::move(docs));
+        }
+        answer.entry.reset();
+        vector<vector<int>>().swap(answer.parts);
+    };
+    auto finish = [&](const size_t q) {
+        lock_guard<mutex> guard(emit_lock);
+        answers[q].finished = true;
+        for (; next < answers.size() && answers[next].finished; next++) {
+            emit(next);
+        }
+    };
+    auto evaluate_part = [&](const size_t q, const int part) {
+        Answer &answer = answers[q];
+        const int parts = answer.parts.size();
+        const int begin = (long long) documents * part / parts;
+        const int end = (long long) documents * (part + 1) / parts;
+        answer.parts[part] = evaluate(index, answer.entry->plan, begin, end).to_vector();
+        if (--answer.remaining == 0) {
+            finish(q);
+        }
+    };
+
+    WorkStealingPool pool(threads);
+    for (size_t q = 0; q < query_strings.size(); q++) {
+        pool.spawn(q % pool.size(), [&, q](const int worker) {
+            Answer &answer = answers[q];
+            answer.entry = prepare_query(index, query_strings[q], cache);
+            if (answer.entry == nullptr || answer.entry->has_result) {
+                finish(q);
+                return;
+            }
+            const size_t parts = std::min<size_t>(pool.size(), plan_cost(answer.entry->plan) / QUERY_SPLIT_COST + 1);
+            answer.parts.resize(std::max<size_t>(1, std::min<size_t>(parts, documents)));
+            answer.remaining = answer.parts.size();
+            for (size_t part = 1; part < answer.parts.size(); part++) {
+                pool.spawn(worker, [&, q, part](int) { evaluate_part(q, part); });
+            }
+            evaluate_part(q, 0);
+        });
+    }
+    pool.run();
+}
+
+/**
+ * The top docs among matches by BM25, best first, ties going to the lower
+ * doc id. Every term of a non-exclude step scores; each doc in matches
+ * holds at least one of them. Candidates are visited with WAND: cursors
+ * are kept sorted by current doc, and the pivot is the first doc at which
+ * the summed weight bounds of the cursors up to it could beat the weakest
+ * doc in the heap. Cursors behind the pivot skip straight to it, so a doc
+ * is only scored when it could make the cut.
+ */
+vector<int> rank_query(const InvertedIndex &index, const QueryPlan &plan, const DocSet &matches, const size_t top) {
+    if (matches.empty() || top == 0) {
+        return {};
+    }
+    struct Scorer {
+        PostingCursor it;
+        int term;
+        double idf;
+        double bound;
+    };
+    vector<int> terms;
+    for (auto &step: plan.steps) {
+        if (step.op != OP_EXCLUDE) {
+            terms.insert(terms.end(), step.terms.begin(), step.terms.end());
+        }
+    }
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    const int documents = index.document_count();
+    const double average = index.average_document_length();
+    vector<Scorer> scorers;
+    for (const int term: terms) {
+        const PostingCursor it = index.cursor(term);
+        const double idf = bm25_idf(it.size(), documents);
+        scorers.push_back({it, term, idf, idf * index.weight_bound(term) * (1 + 1e-9)});
+    }
+
+    typedef pair<double, int> Ranked; // score, doc
+    auto better = [](const Ranked &a, const Ranked &b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    };
+    // the weakest ranked doc on top
+    priority_queue<Ranked, vector<Ranked>, decltype(better)> heap(better);
+    vector<Scorer *> order;
+    for (auto &scorer: scorers) {
+        order.emplace_back(&scorer);
+    }
+    for (;;) {
+        order.erase(std::remove_if(order.begin(), order.end(), [](const Scorer *s) { return s->it.done(); }),
+                    order.end());
+        std::sort(order.begin(), order.end(), [](const Scorer *a, const Scorer *b) {
+            return a->it.doc() < b->it.doc();
+        });
+        // docs come in ascending order, so a later doc must beat the weakest outright
+        const bool full = heap.size() == top;
+        size_t pivot = 0;
+        double reach = 0;
+        for (; pivot < order.size(); pivot++) {
+            reach += order[pivot]->bound;
+            if (!full || reach > heap.top().first) {
+                break;
+            }
+        }
+        if (pivot == order.size()) {
+            break;
+        }
+        const int doc = order[pivot]->it.doc();
+        if (order[0]->it.doc() != doc) {
+            for (size_t i = 0; i < pivot && order[i]->it.doc() < doc; i++) {
+                order[i]->it.advance(doc);
+            }
+            continue;
+        }
+        const bool matched = matches.contains(doc);
+        double score = 0;
+        for (size_t i = 0; i < order.size() && order[i]->it.doc() == doc; i++) {
+            Scorer &scorer = *order[i];
+            if (matched) {
+                const int frequency = index.frequency(scorer.term, scorer.it.ordinal());
+                score += scorer.idf * bm25_weight(frequency, index.document_length(doc), average);
+            }
+            scorer.it.next();
+        }
+        if (!matched) {
+            continue;
+        }
+        if (!full) {
+            heap.emplace(score, doc);
+        } else if (score > heap.top().first) {
+            heap.pop();
+            heap.emplace(score, doc);
+        }
+    }
+    vector<int> ranked(heap.size());
+    for (size_t i = heap.size(); i-- > 0; heap.pop()) {
+        ranked[i] = heap.top().second;
+    }
+    return ranked;
+}
+
+// answer every query line with its top docs by BM25 instead of in doc order
+void start_ranked_query(const InvertedIndex &index, vector<string> &query_strings, ResultWriter &writer,
+                        QueryCache *cache, const size_t top) {
+    for (auto &query: query_strings) {
+        const shared_ptr<const CachedQuery> entry = prepare_query(index, query, cache);
+        if (entry == nullptr) {
+            continue;
+        }
+        if (entry->has_result) {
+            writer.answer(index, rank_query(index, entry->plan, DocSet(entry->result, index.document_count()), top));
+            continue;
+        }
+        const DocSet matches = evaluate(index, entry->plan);
+        writer.answer(index, rank_query(index, entry->plan, matches, top));
+        if (cache != nullptr && cache->caches_results()) {
+            remember_result(*cache, query, *entry, matches.to_vector());
+        }
+    }
+}
+
+// answer every query line into writer, in order
+void start_query(const InvertedIndex &index, vector<string> &query_strings, ResultWriter &writer,
+                 QueryCache *cache = nullptr, const int threads = 1) {
+    if (threads > 1) {
+        start_query_parallel(index, query_strings, writer, cache, threads);
+        return;
+    }
+    DocSet docs;
+    for (auto &query: query_strings) {
+        if (run_query(index, query, cache, docs)) {
+            writer.answer(index, docs.to_vector());
+        }
+    }
+}
+
+// false, adding nothing, when the essay cannot be read
+bool parse_essay(const string &essay, InvertedIndex &index) {
+    const MappedFile file(essay);
+    if (!file.is_open()) {
+        return false;
+    }
+    Tokenizer tokenizer(file.data(), file.data() + file.size());
+    // the title line is both the essay name and part of its text
+    const int doc = index.add_document(tokenizer.peek_line());
+    string_view word;
+    while (tokenizer.next(word)) {
+        index.add_word(doc, word);
+    }
+    return true;
+}
+
+/**
+ * Index data_set into index. With more than one thread the essays are cut
+ * into contiguous ranges, each worker indexes its range into a private shard,
+ * and the shards are merged in range order, which keeps doc ids, term ids
+ * and therefore all output identical to the single-threaded build.
+ */
+void parse_essays(const vector<string> &data_set, InvertedIndex &index, int threads = 1) {
+    const int essays = data_set.size();
+    threads = std::max(1, std::min(threads, essays));
+    if (threads == 1) {
+        for (auto &essay: data_set) {
+            parse_essay(essay, index);
+        }
+        return;
+    }
+    vector<InvertedIndex> shards(threads);
+    vector<thread> workers;
+    for (int w = 0; w < threads; w++) {
+        workers.emplace_back([&, w]() {
+            const int begin = (long long) essays * w / threads;
+            const int end = (long long) essays * (w + 1) / threads;
+            for (int i = begin; i < end; i++) {
+                parse_essay(data_set[i], shards[w]);
+            }
+        });
+    }
+    for (auto &worker: workers) {
+        worker.join();
+    }
+    for (auto &shard: shards) {
+        index.merge(shard);
+    }
+}
+
+/**
+ * A run of an external build, read back one posting at a time. Each word
+ * is stored as its length and letters, then its posting count and the
+ * postings: doc id gap, count and that many word offset gaps each, all
+ * varints.
+ */
+struct RunReader {
+    FILE *file = nullptr;
+    string word;
+    uint32_t postings = 0; // in the current word
+    uint32_t left = 0;     // of those, not read yet
+    int doc = -1;
+    vector<uint32_t> offsets;
+
+    // move to the next word once the current one is read, false at the end of the run
+    bool next_word() {
+        uint32_t length;
+        if (!read_varint(length)) {
+            return false;
+        }
+        word.resize(length);
+        if (fread(&word[0], 1, length, file) != length || !read_varint(postings)) {
+            return false;
+        }
+        left = postings;
+        doc = -1;
+        return true;
+    }
+
+    // the current word's next doc id and its word offsets
+    bool next_posting() {
+        uint32_t gap, count;
+        if (left == 0 || !read_varint(gap) || !read_varint(count)) {
+            return false;
+        }
+        left--;
+        doc += gap + 1;
+        offsets.resize(count);
+        int previous = -1;
+        for (auto &offset: offsets) {
+            if (!read_varint(gap)) {
+                return false;
+            }
+            offset = previous + gap + 1;
+            previous = offset;
+        }
+        return true;
+    }
+
+    bool read_varint(uint32_t &value) {
+        value = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            const int byte = getc(file);
+            if (byte == EOF) {
+                return false;
+            }
+            value |= (uint32_t) (byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+/**
+ * Merge runs given in doc order into one stream in word order: start(word,
+ * postings) for each word, then posting(doc, offsets) for each of its
+ * postings in doc order, straight from the runs. start() can stop the
+ * merge by returning false after setting error.
+ */
+template<typename Start, typename Posting>
+bool merge_runs(const vector<FILE *> &files, Start start, Posting posting, string &error) {
+    vector<RunReader> readers(files.size());
+    auto later = [&](const int a, const int b) {
+        return readers[a].word != readers[b].word ? readers[a].word > readers[b].word : a > b;
+    };
+    priority_queue<int, vector<int>, decltype(later)> heap(later);
+    for (size_t r = 0; r < files.size(); r++) {
+        rewind(files[r]);
+        readers[r].file = files[r];
+        if (readers[r].next_word()) {
+            heap.push(r);
+        }
+    }
+    vector<int> holders;
+    string word;
+    while (!heap.empty()) {
+        word = readers[heap.top()].word;
+        size_t postings = 0;
+        holders.clear();
+        while (!heap.empty() && readers[heap.top()].word == word) {
+            holders.emplace_back(heap.top());
+            postings += readers[heap.top()].postings;
+            heap.pop();
+        }
+        if (!start(word, postings)) {
+            return false;
+        }
+        for (const int r: holders) {
+            RunReader &reader = readers[r];
+            while (reader.left > 0) {
+                if (!reader.next_posting()) {
+                    error = "cannot read back a temporary run";
+                    return false;
+                }
+                posting(reader.doc, reader.offsets);
+            }
+            if (reader.next_word()) {
+                heap.push(r);
+            }
+        }
+    }
+    for (auto &reader: readers) {
+        if (ferror(reader.file)) {
+            error = "cannot read back a temporary run";
+            return false;
+        }
+    }
+    return true;
+}
+
+// runs merged into one at a time, which bounds the temporary files open at once
+const size_t MERGE_FAN_IN = 64;
+
+/**
+ * Single-pass in-memory indexing (SPIMI) for corpora larger than memory.
+ * Essays are indexed into an in-memory run until it outgrows budget,
+ * then the run is written to a temporary file in word order and
+ * dropped. Runs are merged MERGE_FAN_IN at a time into longer runs as
+ * they pile up, so no more than a few fan-ins of files are ever open.
+ * Finally the remaining runs are merged in word order, each posting going
+ * from its run straight into the index sections, which spill to temporary
+ * files past a share of budget. What stays in memory is the vocabulary,
+ * the per-term and per-doc offset tables and a buffer per open run. The
+ * file written to path is identical to what an in-memory build saves.
+ */
+bool build_external(const vector<string> &essays, const string &path, const size_t budget, string &error) {
+    vector<unique_ptr<FILE, int (*)(FILE *)>> runs;
+    vector<int> levels; // merges each run has been through; runs only merge with their level
+    vector<uint32_t> title_offsets = {0};
+    SpillBuffer titles(budget / 8);
+    vector<uint32_t> doc_lengths;
+    // replace the last count runs, which follow each other in doc order, with their merge
+    auto merge_last = [&](const size_t count) {
+        FILE *file = tmpfile();
+        if (file == nullptr) {
+            error = "cannot write a run to a temporary file";
+            return false;
+        }
+        vector<FILE *> files;
+        for (size_t r = runs.size() - count; r < runs.size(); r++) {
+            files.emplace_back(runs[r].get());
+        }
+        string record;
+        int previous = -1;
+        auto start = [&](const string &word, const size_t postings) {
+            fwrite(record.data(), 1, record.size(), file);
+            record.clear();
+            put_varint(record, word.size());
+            record += word;
+            put_varint(record, postings);
+            previous = -1;
+            return true;
+        };
+        auto posting = [&](const int doc, const vector<uint32_t> &offsets) {
+            put_varint(record, doc - previous - 1);
+            previous = doc;
+            put_varint(record, offsets.size());
+            int offset = -1;
+            for (const uint32_t at: offsets) {
+                put_varint(record, at - offset - 1);
+                offset = at;
+            }
+            if (record.size() >= 64 * 1024) {
+                fwrite(record.data(), 1, record.size(), file);
+                record.clear();
+            }
+        };
+        const bool merged = merge_runs(files, start, posting, error);
+        fwrite(record.data(), 1, record.size(), file);
+        const int level = levels.back() + 1;
+        runs.erase(runs.end() - count, runs.end());
+        levels.erase(levels.end() - count, levels.end());
+        runs.emplace_back(file, &fclose);
+        levels.emplace_back(level);
+        if (merged && (fflush(file) != 0 || ferror(file) != 0)) {
+            error = "cannot write a run to a temporary file";
+            return false;
+        }
+        return merged;
+    };
+    InvertedIndex run;
+    auto flush = [&]() {
+        FILE *file = tmpfile();
+        if (file != nullptr) {
+            runs.emplace_back(file, &fclose);
+            levels.emplace_back(0);
+            run.spill_run(file, title_offsets, titles, doc_lengths);
+            run = InvertedIndex();
+        }
+        if (file == nullptr || fflush(file) != 0 || ferror(file) != 0) {
+            error = "cannot write a run to a temporary file";
+            return false;
+        }
+        if (titles.size() > UINT32_MAX) {
+            error = "the titles outgrow the index's 32-bit offsets";
+            return false;
+        }
+        // the last fan-in runs share a level exactly when it is full
+        while (runs.size() >= MERGE_FAN_IN && levels[runs.size() - MERGE_FAN_IN] == levels.back()) {
+            if (!merge_last(MERGE_FAN_IN)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    for (auto &essay: essays) {
+        parse_essay(essay, run);
+        // lists grow by doubling, so they may take up to twice what they hold
+        if (run.build_size() * 2 >= budget && !flush()) {
+            return false;
+        }
+    }
+    if (run.build_size() > 0 && !flush()) {
+        return false;
+    }
+    // up to fan-in - 1 runs can be left on each level
+    while (runs.size() > MERGE_FAN_IN) {
+        if (!merge_last(std::min(MERGE_FAN_IN, runs.size() - MERGE_FAN_IN + 1))) {
+            return false;
+        }
+    }
+
+    vector<FILE *> files;
+    for (auto &file: runs) {
+        files.emplace_back(file.get());
+    }
+    vector<string> words;
+    TermSections term_sections(doc_lengths.data(), average_length(doc_lengths.data(), doc_lengths.size()),
+                               budget / 8);
+    auto start = [&](const string &word, const size_t postings) {
+        if (!words.empty()) {
+            term_sections.finish();
+            if (!term_sections.fits()) {
+                error = "the postings outgrow the index's 32-bit offsets";
+                return false;
+            }
+        }
+        words.emplace_back(word);
+        term_sections.start(postings);
+        return true;
+    };
+    auto posting = [&](const int doc, const vector<uint32_t> &offsets) {
+        term_sections.add_posting(doc, offsets.data(), offsets.size());
+    };
+    if (!merge_runs(files, start, posting, error)) {
+        return false;
+    }
+    if (!words.empty()) {
+        term_sections.finish();
+    }
+    if (!term_sections.fits()) {
+        error = "the postings outgrow the index's 32-bit offsets";
+        return false;
+    }
+    runs.clear();
+
+    const WordSections word_sections(words);
+    ofstream out(path, ios::out | ios::binary);
+    const IndexHeader header = write_image(title_offsets, titles, doc_lengths, word_sections, term_sections,
+                                           [&](const char *data, const size_t length) {
+                                               out.write(data, length);
+                                           });
+    out.seekp(0);
+    out.write((const char *) &header, sizeof(IndexHeader));
+    out.close();
+    if (!out.good() || !titles.good() || !term_sections.good()) {
+        error = "cannot write " + path;
+        return false;
+    }
+    return true;
+}
+
+// staged essays that trigger a flush into a new delta segment
+const size_t DELTA_DOCS = 64;
+// segments past which a background merge folds them all into one
+const size_t MAX_SEGMENTS = 8;
+
+// a frozen piece of a LiveIndex: local doc d is global doc ids[d]
+struct Segment {
+    uint64_t serial = 0;
+    InvertedIndex index;
+    vector<int> ids; // ascending
+};
+
+// where the current version of a doc lives; serial 0 when there is none
+struct DocLocation {
+    uint64_t serial = 0;
+    int local = -1;
+
+    bool operator==(const DocLocation &other) const {
+        return serial == other.serial && local == other.local;
+    }
+};
+
+/**
+ * Immutable view of a LiveIndex. A segment may still hold old versions of
+ * replaced or deleted docs; a local doc only counts when where[] names it
+ * as the doc's current version. Each live doc therefore matches in exactly
+ * one segment, with its full text, so a query is answered segment by
+ * segment and the pieces are unioned.
+ */
+class IndexSnapshot {
+public:
+    // global doc ids matching tree, ascending
+    vector<int> search(const QueryNode &tree) const {
+        vector<int> found;
+        for (auto &segment: segments) {
+            const DocSet docs = evaluate(segment->index, compile_query(segment->index, tree));
+            docs.for_each([&](const int local) {
+                if (is_current(*segment, local)) {
+                    found.emplace_back(segment->ids[local]);
+                }
+            });
+        }
+        std::sort(found.begin(), found.end());
+        return found;
+    }
+
+    string_view title(const int doc) const {
+        const DocLocation &at = where[doc];
+        for (auto &segment: segments) {
+            if (segment->serial == at.serial) {
+                return segment->index.title(at.local);
+            }
+        }
+        return {};
+    }
+
+    // one past the highest doc id ever assigned
+    int document_count() const {
+        return where.size();
+    }
+
+private:
+    friend class LiveIndex;
+
+    vector<shared_ptr<const Segment>> segments;
+    vector<DocLocation> where; // by global doc id
+
+    bool is_current(const Segment &segment, const int local) const {
+        return where[segment.ids[local]] == DocLocation{segment.serial, local};
+    }
+};
+
+/**
+ * Index that takes additions, replacements and deletions without a full
+ * rebuild, in the manner of an LSM tree. Changes are staged in memory and
+ * flush() freezes them into a small delta segment; once there are more
+ * than MAX_SEGMENTS segments a background thread folds them all into one
+ * main segment, dropping dead versions. Doc ids are global and stable, so a
+ * replaced essay keeps its place in the output order.
+ *
+ * Readers take a snapshot(), which stays valid and unchanged while writes
+ * and merges carry on; staged changes become visible at the next flush().
+ */
+class LiveIndex {
+public:
+    ~LiveIndex() {
+        wait_merges();
+    }
+
+    // stage a new essay and return its doc id
+    int add(const string &path) {
+        lock_guard<mutex> guard(write_lock);
+        const int doc = next_doc++;
+        stage(doc, path);
+        return doc;
+    }
+
+    // stage new content for doc, adding it under that id if it is new
+    void replace(const int doc, const string &path) {
+        lock_guard<mutex> guard(write_lock);
+        stage(doc, path);
+    }
+
+    // stage the deletion of doc
+    void remove(const int doc) {
+        lock_guard<mutex> guard(write_lock);
+        stage(doc, "");
+    }
+
+    // make every staged change visible to new snapshots
+    void flush() {
+        lock_guard<mutex> guard(write_lock);
+        flush_staged();
+    }
+
+    shared_ptr<const IndexSnapshot> snapshot() const {
+        lock_guard<mutex> guard(state_lock);
+        return state;
+    }
+
+    // block until any background merge has been installed
+    void wait_merges() {
+        lock_guard<mutex> guard(merge_lock);
+        if (merger.joinable()) {
+            merger.join();
+        }
+    }
+
+private:
+    mutex write_lock;         // serializes writers and merge installs
+    mutable mutex state_lock; // guards the state pointer only
+    mutex merge_lock;         // guards merger
+    shared_ptr<const IndexSnapshot> state = make_shared<IndexSnapshot>();
+    map<int, string> staged;  // doc id to essay path, empty to delete
+    int next_doc = 0;
+    uint64_t serials = 0;
+    thread merger;
+    atomic<bool> merging{false};
+
+    void publish(shared_ptr<const IndexSnapshot> next) {
+        lock_guard<mutex> guard(state_lock);
+        state = std::move(next);
+    }
+
+    void stage(const int doc, const string &path) {
+        staged[doc] = path;
+        next_doc = std::max(next_doc, doc + 1);
+        if (staged.size() >= DELTA_DOCS) {
+            flush_staged();
+        }
+    }
+
+    void flush_staged() {
+        if (staged.empty()) {
+            return;
+        }
+        auto delta = make_shared<Segment>();
+        delta->serial = ++serials;
+        auto next = make_shared<IndexSnapshot>(*snapshot());
+        next->where.resize(std::max<size_t>(next->where.size(), next_doc));
+        for (auto &change: staged) {
+            // an essay that vanished before it could be read counts as deleted
+            if (change.second.empty() || !parse_essay(change.second, delta->index)) {
+                next->where[change.first] = DocLocation();
+                continue;
+            }
+            next->where[change.first] = DocLocation{delta->serial, (int) delta->ids.size()};
+            delta->ids.emplace_back(change.first);
+        }
+        staged.clear();
+        if (!delta->ids.empty()) {
+            delta->index.freeze();
+            next->segments.emplace_back(std::move(delta));
+        }
+        const bool merge = next->segments.size() > MAX_SEGMENTS;
+        publish(std::move(next));
+        if (merge) {
+            start_merge();
+        }
+    }
+
+    void start_merge() {
+        if (merging.exchange(true)) {
+            return;
+        }
+        lock_guard<mutex> guard(merge_lock);
+        if (merger.joinable()) {
+            merger.join();
+        }
+        const uint64_t serial = ++serials;
+        merger = thread([this, serial, from = snapshot()]() { merge(*from, serial); });
+    }
+
+    // fold every segment of from into one, then swap it in for them
+    void merge(const IndexSnapshot &from, const uint64_t serial) {
+        struct Live {
+            int doc;
+            int segment;
+            int local;
+        };
+        vector<Live> live;
+        for (size_t s = 0; s < from.segments.size(); s++) {
+            const Segment &segment = *from.segments[s];
+            for (size_t local = 0; local < segment.ids.size(); local++) {
+                if (from.is_current(segment, local)) {
+                    live.push_back({segment.ids[local], (int) s, (int) local});
+                }
+            }
+        }
+        std::sort(live.begin(), live.end(), [](const Live &a, const Live &b) { return a.doc < b.doc; });
+
+        auto merged = make_shared<Segment>();
+        merged->serial = serial;
+        vector<vector<int>> remap(from.segments.size());
+        for (size_t s = 0; s < from.segments.size(); s++) {
+            remap[s].assign(from.segments[s]->ids.size(), -1);
+        }
+        for (auto &doc: live) {
+            remap[doc.segment][doc.local] = merged->index.add_document(
+                from.segments[doc.segment]->index.title(doc.local));
+            merged->ids.emplace_back(doc.doc);
+        }
+        for (size_t s = 0; s < from.segments.size(); s++) {
+            merged->index.absorb(from.segments[s]->index, remap[s]);
+        }
+        merged->index.freeze();
+
+        {
+            lock_guard<mutex> guard(write_lock);
+            auto next = make_shared<IndexSnapshot>(*snapshot());
+            // a doc changed while merging keeps its newer version
+            for (size_t local = 0; local < live.size(); local++) {
+                DocLocation &at = next->where[live[local].doc];
+                if (at == DocLocation{from.segments[live[local].segment]->serial, live[local].local}) {
+                    at = DocLocation{serial, (int) local};
+                }
+            }
+            auto merged_away = [&](const shared_ptr<const Segment> &segment) {
+                for (auto &source: from.segments) {
+                    if (source->serial == segment->serial) {
+                        return true;
+                    }
+                }
+                return false;
+            };
+            next->segments.erase(std::remove_if(next->segments.begin(), next->segments.end(), merged_away),
+                                 next->segments.end());
+            if (!merged->ids.empty()) {
+                next->segments.insert(next->segments.begin(), std::move(merged));
+            }
+            publish(std::move(next));
+        }
+        merging = false;
+    }
+};
+
+// answer every query line against one snapshot of a live index
+void start_live_query(const IndexSnapshot &snapshot, vector<string> &query_strings, ResultWriter &writer) {
+    for (auto &query: query_strings) {
+        if (normalize_query(query).empty()) {
+            continue;
+        }
+        string error;
+        const unique_ptr<QueryNode> tree = QueryParser(query).parse(error);
+        if (tree == nullptr) {
+            cerr << "Invalid query \"" << query << "\": " << error << endl;
+            writer.answer(snapshot, {});
+            continue;
+        }
+        writer.answer(snapshot, snapshot.search(*tree));
+    }
+}
+
+// essay number of a file name of the form <N>.txt, -1 for anything else
+int essay_number(const string &name) {
+    const string extension = FILE_EXTENSION;
+    if (name.size() <= extension.size() || name.compare(name.size() - extension.size(), string::npos, extension) != 0) {
+        return -1;
+    }
+    const string digits = name.substr(0, name.size() - extension.size());
+    if (digits.size() > 9 || !std::all_of(digits.begin(), digits.end(), ::isdigit)) {
+        return -1;
+    }
+    return stoi(digits);
+}
+
+/**
+ * Service mode: index every <N>.txt in data_dir as doc N, then keep the
+ * index current from inotify events while answering query lines read
+ * from stdin. A background thread turns finished writes and moves into
+ * the directory into replacements, deletions and moves out of it into
+ * removals, and flushes after each batch of events. When the kernel's
+ * event queue overflows, events are lost, so the directory is scanned
+ * again; when the directory itself goes away, the service exits. Each
+ * query runs against the snapshot current when it arrives; its answer
+ * goes to stdout followed by a blank line.
+ */
+int watch_essays(const string &data_dir) {
+#if defined(__linux__)
+    const int inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify < 0 || inotify_add_watch(inotify, data_dir.c_str(),
+                                         IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_MOVE_SELF) < 0) {
+        cerr << "Error watching " << data_dir << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    LiveIndex live;
+    set<int> present; // docs whose essay is in the directory as far as the index knows
+    // (re)index every essay in the directory and drop the docs whose essay is gone
+    auto scan = [&]() {
+        DIR *dir = opendir(data_dir.c_str());
+        if (dir == nullptr) {
+            return false;
+        }
+        set<int> found;
+        for (dirent *entry = readdir(dir); entry != nullptr; entry = readdir(dir)) {
+            const int doc = essay_number(entry->d_name);
+            if (doc >= 0) {
+                live.replace(doc, data_dir + entry->d_name);
+                found.insert(doc);
+            }
+        }
+        closedir(dir);
+        for (const int doc: present) {
+            if (found.count(doc) == 0) {
+                live.remove(doc);
+            }
+        }
+        present.swap(found);
+        live.flush();
+        return true;
+    };
+    // watch first, then scan, so no essay lands unseen in between
+    if (!scan()) {
+        cerr << "Error reading " << data_dir << endl;
+        close(inotify);
+        return 1;
+    }
+    cerr << "watching " << data_dir << ": " << live.snapshot()->document_count() << " essays" << endl;
+
+    atomic<bool> stop{false};
+    thread ingest([&]() {
+        alignas(inotify_event) char events[64 * 1024];
+        pollfd ready{inotify, POLLIN, 0};
+        while (!stop) {
+            if (poll(&ready, 1, 200) <= 0) {
+                continue;
+            }
+            const ssize_t length = read(inotify, events, sizeof(events));
+            bool overflowed = false;
+            for (ssize_t at = 0; at < length;) {
+                const auto *event = reinterpret_cast<const inotify_event *>(events + at);
+                at += sizeof(inotify_event) + event->len;
+                if (event->mask & (IN_IGNORED | IN_MOVE_SELF)) {
+                    // the directory was removed or moved away, nothing more will arrive for it
+                    cerr << "Error: " << data_dir << " is no longer there to watch" << endl;
+                    _exit(1);
+                }
+                overflowed |= (event->mask & IN_Q_OVERFLOW) != 0;
+                const int doc = event->len > 0 ? essay_number(event->name) : -1;
+                if (doc < 0) {
+                    continue;
+                }
+                if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                    live.replace(doc, data_dir + event->name);
+                    present.insert(doc);
+                } else {
+                    live.remove(doc);
+                    present.erase(doc);
+                }
+            }
+            if (overflowed) {
+                cerr << "inotify queue overflowed, rescanning " << data_dir << endl;
+                if (!scan()) {
+                    cerr << "Error reading " << data_dir << endl;
+                }
+            }
+            live.flush();
+        }
+    });
+
+    ResultWriter writer(cout);
+    string query;
+    while (getline(cin, query)) {
+        if (normalize_query(query).empty()) {
+            continue;
+        }
+        vector<string> single = {query};
+        start_live_query(*live.snapshot(), single, writer);
+        writer.line("");
+        writer.flush();
+    }
+    stop = true;
+    ingest.join();
+    close(inotify);
+    return 0;
+#else
+    cerr << "watch mode needs inotify, which this platform lacks (" << data_dir << ")" << endl;
+    return 1;
+#endif
+}
+
+// longest query line a client may send before it is disconnected
+const size_t MAX_REQUEST = 1 << 16;
+
+volatile sig_atomic_t stop_serving = 0;
+
+// the titles of docs, or "Not Found!", one per line and then a blank line
+void append_answer(string &out, const InvertedIndex &index, const DocSet &docs) {
+    if (docs.empty()) {
+        out += "Not Found!\n";
+    }
+    docs.for_each([&](const int doc) {
+        const string_view title = index.title(doc);
+        out.append(title.data(), title.size());
+        out += '\n';
+    });
+    out += '\n';
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+bool socket_address(const string &path, sockaddr_un &address) {
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << "Error: socket path " << path << " is too long" << endl;
+        return false;
+    }
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// a connected stream socket, -1 when nothing listens on path
+int connect_socket(const string &path) {
+    sockaddr_un address{};
+    if (!socket_address(path, address)) {
+        return -1;
+    }
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (const sockaddr *) &address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+// answer a batch of complete request lines, appending every response to out in order
+typedef function<void(const vector<string> &lines, string &out)> LineHandler;
+
+/**
+ * Handler for a line server whose answers come later, such as from other
+ * processes. submit(ticket, lines) starts on a batch, and its answer goes
+ * to finish(ticket, answer) whenever it is ready, in any order across
+ * tickets; the server keeps each client's answers in request order. When
+ * descriptor is set, usually to an epoll set of the backend's own
+ * sockets, it joins the server's loop, which then wakes when it is
+ * readable or after wait_ms(), and calls process() on every wakeup.
+ */
+struct LineBackend {
+    function<void(uint64_t ticket, const vector<string> &lines)> submit;
+    int descriptor = -1;
+    function<int()> wait_ms;
+    function<void()> process;
+    function<void(uint64_t ticket, string answer)> finish; // set by the server
+};
+
+/**
+ * Line server on a Unix domain socket. Clients may pipeline any number of
+ * request lines without waiting for responses. A single epoll loop reads
+ * whatever has arrived, submits every complete line to the backend in one
+ * batch, and keeps unsent output per connection, polling for writability
+ * only while some is backed up. Batches still being answered never hold
+ * up the loop. A client that shuts down its sending side gets its
+ * remaining responses before the server closes the connection.
+ */
+int serve_lines(const string &socket_path, const string &banner, LineBackend &backend) {
+#if defined(__linux__)
+    sockaddr_un address{};
+    if (!socket_address(socket_path, address)) {
+        return 1;
+    }
+    const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(socket_path.c_str());
+    if (listener < 0 || bind(listener, (const sockaddr *) &address, sizeof(address)) < 0 ||
+        listen(listener, SOMAXCONN) < 0) {
+        cerr << "Error listening on " << socket_path << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    const int epoll = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event watch{};
+    watch.events = EPOLLIN;
+    watch.data.fd = listener;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &watch);
+    if (backend.descriptor >= 0) {
+        watch.data.fd = backend.descriptor;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, backend.descriptor, &watch);
+    }
+    signal(SIGINT, [](int) { stop_serving = 1; });
+    signal(SIGTERM, [](int) { stop_serving = 1; });
+    cerr << banner << " on " << socket_path << endl;
+
+    struct Connection {
+        string in;
+        string out;
+        size_t sent = 0;  // bytes of out already written
+        bool ended = false; // the client is done sending
+        deque<uint64_t> waiting;    // tickets not answered yet, in request order
+        map<uint64_t, string> early; // answers that overtook an earlier ticket
+    };
+    unordered_map<int, Connection> connections;
+    unordered_map<uint64_t, int> owners; // ticket to the connection awaiting it
+    uint64_t tickets = 0;
+    vector<int> answered; // connections with new output to flush
+    backend.finish = [&](const uint64_t ticket, string answer) {
+        const auto owner = owners.find(ticket);
+        if (owner == owners.end()) {
+            return; // the client has gone
+        }
+        const int fd = owner->second;
+        owners.erase(owner);
+        Connection &connection = connections[fd];
+        connection.early.emplace(ticket, std::move(answer));
+        while (!connection.waiting.empty()) {
+            const auto next = connection.early.find(connection.waiting.front());
+            if (next == connection.early.end()) {
+                break;
+            }
+            connection.out += next->second;
+            connection.early.erase(next);
+            connection.waiting.pop_front();
+        }
+        answered.emplace_back(fd);
+    };
+    auto drop = [&](const int fd) {
+        epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        for (const uint64_t ticket: connections[fd].waiting) {
+            owners.erase(ticket);
+        }
+        connections.erase(fd);
+    };
+    // submit every complete line in the input buffer
+    auto answer = [&](const int fd, Connection &connection) {
+        vector<string> lines;
+        size_t start = 0;
+        for (size_t newline; (newline = connection.in.find('\n', start)) != string::npos; start = newline + 1) {
+            lines.emplace_back(connection.in.substr(start, newline - start));
+        }
+        connection.in.erase(0, start);
+        if (!lines.empty()) {
+            const uint64_t ticket = ++tickets;
+            owners[ticket] = fd;
+            connection.waiting.emplace_back(ticket);
+            backend.submit(ticket, lines);
+        }
+    };
+    // false once the connection should be closed
+    auto flush = [&](const int fd, Connection &connection) {
+        while (connection.sent < connection.out.size()) {
+            const ssize_t n = send(fd, connection.out.data() + connection.sent,
+                                   connection.out.size() - connection.sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                return false;
+            }
+            connection.sent += n;
+        }
+        const bool drained = connection.sent == connection.out.size();
+        if (drained) {
+            connection.out.clear();
+            connection.sent = 0;
+        }
+        epoll_event event{};
+        // once the client is done sending, EOF would keep reporting readable
+        event.events = (connection.ended ? 0u : (uint32_t) EPOLLIN) | (drained ? 0u : (uint32_t) EPOLLOUT);
+        event.data.fd = fd;
+        epoll_ctl(epoll, EPOLL_CTL_MOD, fd, &event);
+        return !(drained && connection.ended && connection.waiting.empty());
+    };
+
+    epoll_event ready[64];
+    char chunk[64 * 1024];
+    while (!stop_serving) {
+        const int count = epoll_wait(epoll, ready, 64, backend.wait_ms ? backend.wait_ms() : -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            const int fd = ready[i].data.fd;
+            if (fd == backend.descriptor) {
+                continue;
+            }
+            if (fd == listener) {
+                for (int client; (client = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0;) {
+                    epoll_event event{};
+                    event.events = EPOLLIN;
+                    event.data.fd = client;
+                    epoll_ctl(epoll, EPOLL_CTL_ADD, client, &event);
+                    connections[client];
+                }
+                continue;
+            }
+            Connection &connection = connections[fd];
+            if (ready[i].events & (EPOLLHUP | EPOLLERR)) {
+                // closed both ways, so there is no one left to answer
+                drop(fd);
+                continue;
+            }
+            if (ready[i].events & EPOLLIN) {
+                for (;;) {
+                    const ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+                    if (n > 0) {
+                        connection.in.append(chunk, n);
+                        continue;
+                    }
+                    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                        connection.ended = true;
+                    }
+                    break;
+                }
+                if (connection.ended && !connection.in.empty()) {
+                    connection.in += '\n'; // answer a last line sent without its newline
+                }
+                answer(fd, connection);
+                if (connection.in.size() > MAX_REQUEST) {
+                    drop(fd);
+                    continue;
+                }
+            }
+            if (!flush(fd, connection)) {
+                drop(fd);
+            }
+        }
+        if (backend.process) {
+            backend.process();
+        }
+        for (const int fd: answered) {
+            const auto connection = connections.find(fd);
+            if (connection != connections.end() && !flush(fd, connection->second)) {
+                drop(fd);
+            }
+        }
+        answered.clear();
+    }
+    for (auto &connection: connections) {
+        close(connection.first);
+    }
+    close(epoll);
+    close(listener);
+    unlink(socket_path.c_str());
+    return 0;
+#else
+    cerr << "serve mode needs epoll, which this platform lacks (" << socket_path << ", " << banner << ")" << endl;
+    return 1;
+#endif
+}
+
+// a line server that answers each batch as it arrives
+int serve_lines(const string &socket_path, const string &banner, const LineHandler &handle) {
+    LineBackend backend;
+    backend.submit = [&](const uint64_t ticket, const vector<string> &lines) {
+        string out;
+        handle(lines, out);
+        backend.finish(ticket, std::move(out));
+    };
+    return serve_lines(socket_path, banner, backend);
+}
+
+/**
+ * Query server: for each non-blank query line, in order, the matching
+ * titles (or "Not Found!") followed by a blank line.
+ */
+int serve_queries(const InvertedIndex &index, const string &socket_path, QueryCache *cache) {
+    const string banner = "serving " + to_string(index.document_count()) + " essays";
+    return serve_lines(socket_path, banner, [&](const vector<string> &lines, string &out) {
+        DocSet docs;
+        for (auto &line: lines) {
+            if (run_query(index, line, cache, docs)) {
+                append_answer(out, index, docs);
+            }
+        }
+    });
+}
+
+// the essays of shard k of n: a contiguous run, so shards in order keep global doc order
+vector<string> shard_range(const vector<string> &essays, const int k, const int n) {
+    const size_t begin = essays.size() * k / n;
+    const size_t end = essays.size() * (k + 1) / n;
+    return vector<string>(essays.begin() + begin, essays.begin() + end);
+}
+
+// how long a shard may go without making progress on a batch before it counts as failed
+const int SHARD_TIMEOUT_MS = 10000;
+
+/**
+ * Non-blocking client side of one shard server for the coordinator:
+ * request lines are queued and written as the socket takes them, and
+ * answers are parsed out of whatever has been received, in request order.
+ */
+class ShardLink {
+public:
+    explicit ShardLink(string path) : path(std::move(path)) {
+    }
+
+    ~ShardLink() {
+        disconnect();
+    }
+
+    ShardLink(const ShardLink &) = delete;
+    ShardLink &operator=(const ShardLink &) = delete;
+
+    const string &socket_path() const {
+        return path;
+    }
+
+    int descriptor() const {
+        return fd;
+    }
+
+    bool connected() const {
+        return fd >= 0;
+    }
+
+    // connect, retrying while the shard is still starting up
+    bool open(const int attempts) {
+#if defined(__unix__) || defined(__APPLE__)
+        for (int i = 0; i < attempts && fd < 0; i++) {
+            if (i > 0) {
+                this_thread::sleep_for(chrono::milliseconds(100));
+            }
+            fd = connect_socket(path);
+        }
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+#endif
+        return fd >= 0;
+    }
+
+    // drop the connection and everything queued or received on it
+    void disconnect() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+        fd = -1;
+        out.clear();
+        sent = 0;
+        pending.clear();
+        start = 0;
+    }
+
+    void queue(const string &lines) {
+        out += lines;
+    }
+
+    bool sending() const {
+        return sent < out.size();
+    }
+
+    // write as much of the queue as the socket takes, false when the shard is gone
+    bool send_some() {
+#if defined(__unix__) || defined(__APPLE__)
+        while (sent < out.size()) {
+            const ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            sent += n;
+        }
+#endif
+        out.clear();
+        sent = 0;
+        return true;
+    }
+
+    // take in whatever has arrived, false once the shard has closed or failed
+    bool receive_some() {
+        pending.erase(0, start);
+        start = 0;
+#if defined(__unix__) || defined(__APPLE__)
+        char chunk[64 * 1024];
+        for (;;) {
+            const ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0) {
+                return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            }
+            pending.append(chunk, n);
+        }
+#else
+        return false;
+#endif
+    }
+
+    // the title lines of the next complete answer, without its closing blank line
+    bool take_answer(vector<string> &titles) {
+        titles.clear();
+        for (size_t at = start, newline; (newline = pending.find('\n', at)) != string::npos; at = newline + 1) {
+            if (newline == at) {
+                start = newline + 1;
+                return true;
+            }
+            titles.emplace_back(pending, at, newline - at);
+        }
+        return false;
+    }
+
+private:
+    string path;
+    int fd = -1;
+    string out;       // request lines not yet written
+    size_t sent = 0;  // bytes of out already written
+    string pending;   // received bytes not yet consumed
+    size_t start = 0; // first unconsumed byte of pending
+};
+
+/**
+ * Coordinator over shard servers given in doc range order. Each batch of
+ * client lines goes to every shard at once, and the answers are gathered
+ * from the shard sockets' events in the server's own loop, so the shards
+ * work in parallel and a batch waiting on a slow shard holds up no other
+ * client. A shard answers in request order on its connection, so the
+ * batches it still owes answers to form a queue. Shards cover consecutive
+ * doc ranges and answer in doc order, so concatenating their titles in
+ * shard order is the merge into global doc order; a shard's "Not Found!"
+ * contributes nothing.
+ *
+ * Answers are never partial. A shard that fails, or owes answers and
+ * makes no progress for SHARD_TIMEOUT_MS, is dropped and reconnected for
+ * the next batch; every query it could not answer gets the line
+ * "Error: shard <socket> is unavailable" instead.
+ */
+int coordinate_queries(const string &socket_path, const vector<string> &shard_sockets, const int attempts) {
+#if defined(__linux__)
+    vector<unique_ptr<ShardLink>> shards;
+    for (auto &path: shard_sockets) {
+        shards.emplace_back(make_unique<ShardLink>(path));
+        if (!shards.back()->open(attempts)) {
+            cerr << "Error connecting to shard " << path << endl;
+            return 1;
+        }
+    }
+    struct Batch {
+        size_t queries = 0;
+        size_t shards_left = 0;
+        vector<vector<vector<string>>> found; // titles per query and shard
+        vector<string> missing;               // a shard that could not answer the query
+    };
+    // a batch a shard still owes answers to, and how many it has given
+    struct Owed {
+        uint64_t ticket;
+        size_t answered;
+    };
+    typedef chrono::steady_clock Clock;
+    unordered_map<uint64_t, Batch> batches;
+    vector<deque<Owed>> owed(shards.size());
+    vector<Clock::time_point> deadline(shards.size());
+    vector<bool> down(shards.size(), false);
+    const int epoll = epoll_create1(EPOLL_CLOEXEC);
+    LineBackend backend;
+    backend.descriptor = epoll;
+
+    auto watch = [&](const size_t s, const int operation) {
+        epoll_event event{};
+        event.events = EPOLLIN | (shards[s]->sending() ? (uint32_t) EPOLLOUT : 0u);
+        event.data.u64 = s;
+        epoll_ctl(epoll, operation, shards[s]->descriptor(), &event);
+    };
+    for (size_t s = 0; s < shards.size(); s++) {
+        watch(s, EPOLL_CTL_ADD);
+    }
+    // one more shard is done with the batch, which is answered once every shard is
+    auto shard_done = [&](const uint64_t ticket) {
+        Batch &batch = batches[ticket];
+        if (--batch.shards_left > 0) {
+            return;
+        }
+        string out;
+        for (size_t q = 0; q < batch.queries; q++) {
+            const size_t before = out.size();
+            if (!batch.missing[q].empty()) {
+                out += "Error: shard " + batch.missing[q] + " is unavailable\n";
+            } else {
+                for (auto &titles: batch.found[q]) {
+                    for (auto &title: titles) {
+                        out += title;
+                        out += '\n';
+                    }
+                }
+            }
+            if (out.size() == before) {
+                out += "Not Found!\n";
+            }
+            out += '\n';
+        }
+        batches.erase(ticket);
+        backend.finish(ticket, std::move(out));
+    };
+    // the queries of ticket from the first-th on get no answer from shard s
+    auto miss = [&](const size_t s, const uint64_t ticket, const size_t first) {
+        Batch &batch = batches[ticket];
+        for (size_t q = first; q < batch.queries; q++) {
+            if (batch.missing[q].empty()) {
+                batch.missing[q] = shards[s]->socket_path();
+            }
+        }
+        shard_done(ticket);
+    };
+    // shard s answers nothing more that it owes
+    auto fail = [&](const size_t s, const char *why) {
+        if (!down[s]) {
+            cerr << "shard " << shards[s]->socket_path() << " " << why << endl;
+            down[s] = true;
+        }
+        shards[s]->disconnect();
+        deque<Owed> unanswered;
+        unanswered.swap(owed[s]);
+        for (auto &batch: unanswered) {
+            miss(s, batch.ticket, batch.answered);
+        }
+    };
+
+    backend.submit = [&](const uint64_t ticket, const vector<string> &lines) {
+        string text;
+        size_t queries = 0;
+        for (auto &line: lines) {
+            if (!normalize_query(line).empty()) {
+                text += line;
+                text += '\n';
+                queries++;
+            }
+        }
+        if (queries == 0) {
+            backend.finish(ticket, "");
+            return;
+        }
+        Batch &batch = batches[ticket];
+        batch.queries = queries;
+        batch.shards_left = shards.size();
+        batch.found.assign(queries, vector<vector<string>>(shards.size()));
+        batch.missing.assign(queries, "");
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (!shards[s]->connected()) {
+                if (!shards[s]->open(1)) {
+                    fail(s, "is unavailable");
+                    miss(s, ticket, 0);
+                    continue;
+                }
+                watch(s, EPOLL_CTL_ADD);
+            }
+            if (down[s]) {
+                cerr << "shard " << shards[s]->socket_path() << " is back" << endl;
+                down[s] = false;
+            }
+            if (owed[s].empty()) {
+                deadline[s] = Clock::now() + chrono::milliseconds(SHARD_TIMEOUT_MS);
+            }
+            owed[s].push_back({ticket, 0});
+            shards[s]->queue(text);
+            if (!shards[s]->send_some()) {
+                fail(s, "was lost");
+                continue;
+            }
+            watch(s, EPOLL_CTL_MOD);
+        }
+    };
+
+    backend.wait_ms = [&]() {
+        int wait = -1;
+        const Clock::time_point now = Clock::now();
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (!owed[s].empty()) {
+                const auto left = chrono::duration_cast<chrono::milliseconds>(deadline[s] - now).count() + 1;
+                wait = wait < 0 ? std::max<int>(0, left) : std::min<int>(wait, std::max<int>(0, left));
+            }
+        }
+        return wait;
+    };
+
+    backend.process = [&]() {
+        epoll_event ready[64];
+        vector<string> titles;
+        for (int count; (count = epoll_wait(epoll, ready, 64, 0)) > 0;) {
+            for (int i = 0; i < count; i++) {
+                const size_t s = ready[i].data.u64;
+                if (!shards[s]->connected()) {
+                    continue;
+                }
+                const uint32_t events = ready[i].events;
+                bool alive = !(events & EPOLLOUT) || shards[s]->send_some();
+                if (alive && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    alive = shards[s]->receive_some();
+                }
+                deadline[s] = Clock::now() + chrono::milliseconds(SHARD_TIMEOUT_MS);
+                while (!owed[s].empty() && shards[s]->take_answer(titles)) {
+                    Owed &front = owed[s].front();
+                    Batch &batch = batches[front.ticket];
+                    if (titles.size() != 1 || titles[0] != "Not Found!") {
+                        batch.found[front.answered][s].swap(titles);
+                    }
+                    if (++front.answered == batch.queries) {
+                        const uint64_t ticket = front.ticket;
+                        owed[s].pop_front();
+                        shard_done(ticket);
+                    }
+                }
+                if (!alive) {
+                    fail(s, "was lost");
+                } else {
+                    watch(s, EPOLL_CTL_MOD);
+                }
+            }
+            if (count < 64) {
+                break;
+            }
+        }
+        const Clock::time_point now = Clock::now();
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (!owed[s].empty() && now >= deadline[s]) {
+                fail(s, "timed out");
+            }
+        }
+    };
+
+    const string banner = "coordinating " + to_string(shards.size()) + " shards";
+    const int status = serve_lines(socket_path, banner, backend);
+    close(epoll);
+    return status;
+#else
+    cerr << "coordinate mode needs epoll, which this platform lacks (" << socket_path << ", "
+         << shard_sockets.size() << " shards, " << attempts << " attempts)" << endl;
+    return 1;
+#endif
+}
+
+/**
+ * Client for serve_queries(): sends every line of query_file (stdin when
+ * empty) in one pipelined stream and prints the answers in the batch
+ * output format, dropping the blank line after each answer. Sending runs
+ * on its own thread so a large batch cannot deadlock against the answers
+ * filling the socket the other way.
+ */
+int query_client(const string &socket_path, const string &query_file) {
+#if defined(__unix__) || defined(__APPLE__)
+    const int fd = connect_socket(socket_path);
+    if (fd < 0) {
+        cerr << "Error connecting to " << socket_path << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    vector<string> queries;
+    if (query_file.empty()) {
+        for (string line; getline(cin, line);) {
+            queries.emplace_back(line);
+        }
+    } else {
+        queries = parse_query(query_file);
+    }
+    thread sender([&]() {
+        string batch;
+        for (auto &query: queries) {
+            batch += query;
+            batch += '\n';
+        }
+        for (size_t sent = 0; sent < batch.size();) {
+            const ssize_t n = send(fd, batch.data() + sent, batch.size() - sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                break;
+            }
+            sent += n;
+        }
+        shutdown(fd, SHUT_WR);
+    });
+
+    ResultWriter writer(cout);
+    string pending;
+    char chunk[64 * 1024];
+    for (ssize_t n; (n = recv(fd, chunk, sizeof(chunk), 0)) > 0;) {
+        pending.append(chunk, n);
+        size_t start = 0;
+        for (size_t newline; (newline = pending.find('\n', start)) != string::npos; start = newline + 1) {
+            if (newline > start) {
+                writer.line(string_view(pending).substr(start, newline - start));
+            }
+        }
+        pending.erase(0, start);
+    }
+    sender.join();
+    close(fd);
+    return writer.flush() ? 0 : 1;
+#else
+    cerr << "client mode needs Unix domain sockets (" << socket_path << ", " << query_file << ")" << endl;
+    return 1;
+#endif
+}
+
+// essays are named 0.txt, 1.txt, ... and the essay index is the doc id
+vector<string> list_essays(const string &data_dir) {
+    vector<string> data_set;
+    for (int i = 0; ; i++) {
+        const string path = data_dir + to_string(i) + FILE_EXTENSION;
+        ifstream probe(path);
+        if (!probe.is_open()) {
+            break;
+        }
+        data_set.emplace_back(path);
+    }
+    return data_set;
+}
+
+/**
+ * Keep a shard server on index running: the server is a forked child, and
+ * one that dies is forked again from the index already built, so it is back
+ * within milliseconds and the coordinator reconnects on its next batch.
+ * SIGTERM or SIGINT stops the server and then the supervisor.
+ */
+int supervise_shard(const InvertedIndex &index, const string &socket_path) {
+#if defined(__unix__) || defined(__APPLE__)
+    struct sigaction stop{};
+    stop.sa_handler = [](int) { stop_serving = 1; };
+    sigaction(SIGTERM, &stop, nullptr);
+    sigaction(SIGINT, &stop, nullptr);
+    while (!stop_serving) {
+        const pid_t server = fork();
+        if (server == 0) {
+            _exit(serve_queries(index, socket_path, nullptr));
+        }
+        if (server < 0) {
+            cerr << "Error starting the server for " << socket_path << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        int status = 0;
+        while (waitpid(server, &status, 0) < 0 && errno == EINTR) {
+            // interrupted by a stop signal: pass it on and wait for the server to finish
+            kill(server, SIGTERM);
+        }
+        if (!stop_serving) {
+            cerr << "shard server on " << socket_path << " died, restarting it" << endl;
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+    }
+    return 0;
+#else
+    cerr << "shard supervision needs fork (" << index.document_count() << " essays, " << socket_path << ")" << endl;
+    return 1;
+#endif
+}
+
+/**
+ * Run a sharded deployment on one machine: fork a supervised server per
+ * shard, each indexing only its own doc range and listening on
+ * <socket_path>.<k>, then coordinate them on socket_path. The shard
+ * processes are stopped when the coordinator exits.
+ */
+int serve_sharded(const string &data_dir, const string &socket_path, const int shard_count, const int threads) {
+#if defined(__unix__) || defined(__APPLE__)
+    const vector<string> essays = list_essays(data_dir);
+    vector<pid_t> children;
+    vector<string> shard_sockets;
+    for (int k = 0; k < shard_count; k++) {
+        shard_sockets.emplace_back(socket_path + "." + to_string(k));
+        const pid_t child = fork();
+        if (child == 0) {
+            InvertedIndex index;
+            parse_essays(shard_range(essays, k, shard_count), index, threads);
+            index.freeze();
+            _exit(supervise_shard(index, shard_sockets.back()));
+        }
+        if (child < 0) {
+            cerr << "Error starting shard " << k << ": " << strerror(errno) << endl;
+            break;
+        }
+        children.emplace_back(child);
+    }
+    // shards need time to index before they listen
+    const int status = (int) children.size() == shard_count ? coordinate_queries(socket_path, shard_sockets, 600) : 1;
+    for (const pid_t child: children) {
+        kill(child, SIGTERM);
+        waitpid(child, nullptr, 0);
+    }
+    return status;
+#else
+    cerr << "sharded serving needs fork (" << data_dir << ", " << socket_path << ", "
+         << shard_count << " shards, " << threads << " threads)" << endl;
+    return 1;
+#endif
+}
+
+/**
+ * Tokenizer micro-benchmark. Every essay in data_dir is loaded once, then
+ * tokenized by the original getline + split() + word_parse() path and by
+ * each classification kernel the CPU supports. Word counts and a checksum
+ * over the lowercased words confirm all paths agree; the best of 5 rounds
+ * is reported.
+ */
+int bench_tokenizer(const string &data_dir) {
+    vector<string> texts;
+    size_t bytes = 0;
+    for (auto &path: list_essays(data_dir)) {
+        const MappedFile file(path);
+        texts.emplace_back(file.data(), file.size());
+        bytes += file.size();
+    }
+    if (texts.empty()) {
+        cerr << "no essays in " << data_dir << endl;
+        return 1;
+    }
+
+    auto measure = [&](const string &name, auto &&tokenize) {
+        double best = 1e30;
+        size_t words = 0, checksum = 0;
+        for (int round = 0; round < 5; round++) {
+            words = checksum = 0;
+            const auto begin = chrono::steady_clock::now();
+            for (auto &text: texts) {
+                tokenize(text, words, checksum);
+            }
+            const chrono::duration<double, milli> took = chrono::steady_clock::now() - begin;
+            best = std::min(best, took.count());
+        }
+        cout << name << ": " << words << " words, checksum " << checksum << ", "
+             << best << " ms, " << bytes / best / 1000.0 << " MB/s" << endl;
+    };
+    auto add = [](string_view word, size_t &words, size_t &checksum) {
+        words++;
+        for (const char ch: word) {
+            checksum = checksum * 31 + tolower((unsigned char) ch);
+        }
+    };
+
+    cout << texts.size() << " essays, " << bytes << " bytes" << endl;
+    measure("split+word_parse", [&](const string &text, size_t &words, size_t &checksum) {
+        istringstream in(text);
+        string line;
+        while (getline(in, line)) {
+            for (auto &word: word_parse(split(line, " "))) {
+                if (!word.empty()) {
+                    add(word, words, checksum);
+                }
+            }
+        }
+    });
+    vector<pair<string, ClassifyKernel>> kernels = {{"scalar", classify_scalar}};
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        kernels.emplace_back("sse2", classify_sse2);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.emplace_back("avx2", classify_avx2);
+    }
+#endif
+    for (auto &kernel: kernels) {
+        measure("kernel " + kernel.first, [&](const string &text, size_t &words, size_t &checksum) {
+            Tokenizer tokenizer(text.data(), text.data() + text.size(), kernel.second);
+            string_view word;
+            while (tokenizer.next(word)) {
+                add(word, words, checksum);
+            }
+        });
+    }
+    return 0;
+}
+
+/**
+ * Set-algebra micro-benchmark over the operator queries of query_file. The
+ * operand doc sets of every such query are looked up once; then combining
+ * them is timed with std::set (how start_query used to do it), with a plain
+ * merge over sorted vectors, and with DocSet's adaptive strategies. Result
+ * sizes are cross-checked and the best of 20 rounds is reported.
+ */
+int bench_setops(const string &data_dir, const string &query_file, const int threads) {
+    InvertedIndex index;
+    parse_essays(list_essays(data_dir), index, threads);
+    index.freeze();
+
+    struct OperatorQuery {
+        vector<vector<int>> operands;
+        vector<char> operations;
+    };
+    vector<OperatorQuery> queries;
+    for (auto &query: parse_query(query_file)) {
+        string error;
+        const unique_ptr<QueryNode> tree = QueryParser(query).parse(error);
+        if (tree == nullptr || tree->op == 0) {
+            continue;
+        }
+        OperatorQuery parsed;
+        const QueryNode *node = tree.get();
+        for (; node->op != 0; node = node->left.get()) {
+            parsed.operations.emplace_back(node->op);
+            parsed.operands.emplace_back(index.lookup(node->right->term.text, node->right->term.kind));
+        }
+        parsed.operands.emplace_back(index.lookup(node->term.text, node->term.kind));
+        std::reverse(parsed.operations.begin(), parsed.operations.end());
+        std::reverse(parsed.operands.begin(), parsed.operands.end());
+        queries.emplace_back(std::move(parsed));
+    }
+    cout << queries.size() << " operator queries" << endl;
+
+    auto measure = [&](const string &name, auto &&evaluate) {
+        double best = 1e30;
+        size_t hits = 0;
+        for (int round = 0; round < 20; round++) {
+            hits = 0;
+            const auto begin = chrono::steady_clock::now();
+            for (auto &query: queries) {
+                hits += evaluate(query);
+            }
+            const chrono::duration<double, micro> took = chrono::steady_clock::now() - begin;
+            best = std::min(best, took.count());
+        }
+        cout << name << ": " << hits << " hits, " << best << " us, "
+             << best / queries.size() << " us/query" << endl;
+    };
+
+    measure("std::set", [](const OperatorQuery &query) {
+        set<int> docs(query.operands[0].begin(), query.operands[0].end());
+        for (size_t i = 0; i < query.operations.size(); i++) {
+            const set<int> other(query.operands[i + 1].begin(), query.operands[i + 1].end());
+            set<int> combined;
+            if (query.operations[i] == OP_AND) {
+                set_intersection(docs.begin(), docs.end(), other.begin(), other.end(),
+                                 inserter(combined, combined.begin()));
+            } else if (query.operations[i] == OP_OR) {
+                combined = docs;
+                combined.insert(other.begin(), other.end());
+            } else {
+                set_difference(docs.begin(), docs.end(), other.begin(), other.end(),
+                               inserter(combined, combined.begin()));
+            }
+            docs.swap(combined);
+        }
+        return docs.size();
+    });
+    measure("sorted merge", [](const OperatorQuery &query) {
+        vector<int> docs = query.operands[0];
+        for (size_t i = 0; i < query.operations.size(); i++) {
+            const vector<int> &other = query.operands[i + 1];
+            vector<int> combined;
+            if (query.operations[i] == OP_AND) {
+                set_intersection(docs.begin(), docs.end(), other.begin(), other.end(), back_inserter(combined));
+            } else if (query.operations[i] == OP_OR) {
+                set_union(docs.begin(), docs.end(), other.begin(), other.end(), back_inserter(combined));
+            } else {
+                set_difference(docs.begin(), docs.end(), other.begin(), other.end(), back_inserter(combined));
+            }
+            docs.swap(combined);
+        }
+        return docs.size();
+    });
+    const int universe = index.document_count();
+    measure("DocSet", [&](const OperatorQuery &query) {
+        DocSet docs(query.operands[0], universe);
+        for (size_t i = 0; i < query.operations.size(); i++) {
+            const DocSet other(query.operands[i + 1], universe);
+            if (query.operations[i] == OP_AND) {
+                docs = intersect(docs, other);
+            } else if (query.operations[i] == OP_OR) {
+                docs = unite(docs, other);
+            } else {
+                docs = subtract(docs, other);
+            }
+        }
+        return docs.size();
+    });
+    return 0;
+}
+
+string json_string(string_view text) {
+    string out = "\"";
+    for (const char ch: text) {
+        if (ch == '"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if ((unsigned char) ch < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+            out += escaped;
+        } else {
+            out += ch;
+        }
+    }
+    return out + "\"";
+}
+
+// latency category of a parsed query
+const char *query_category(const QueryNode &tree) {
+    static const char *const kinds[] = {"exact", "prefix", "suffix", "wildcard", "phrase", "near", "fuzzy", "substring"};
+    return tree.op != 0 ? "operator" : kinds[tree.term.kind];
+}
+
+// peak resident set of this process so far, in KiB
+long peak_rss_kb() {
+#if defined(__unix__) || defined(__APPLE__)
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Benchmark and regression run over (data_dir, query_file, expected_output)
+ * triples. For each set it times the index build, sizes the index, answers
+ * every query BENCH_ROUNDS times keeping the fastest, and reports latency
+ * percentiles per query category; the answers of the first round are then
+ * compared line by line with the expected output. Everything is printed
+ * as one JSON document on stdout. Fails when any set's answers differ.
+ */
+const int BENCH_ROUNDS = 3;
+
+int bench_suite(const vector<string> &sets, const int threads) {
+    bool all_correct = true;
+    cout << "{\n  \"threads\": " << threads << ",\n  \"sets\": [";
+    for (size_t set = 0; set + 2 < sets.size(); set += 3) {
+        const string &data_dir = sets[set], &query_file = sets[set + 1], &expected_file = sets[set + 2];
+        InvertedIndex index;
+        const auto build_begin = chrono::steady_clock::now();
+        parse_essays(list_essays(data_dir + "/"), index, threads);
+        index.freeze();
+        const chrono::duration<double, milli> build = chrono::steady_clock::now() - build_begin;
+
+        map<string, vector<double>> latencies; // microseconds, by category
+        vector<string> lines;
+        double total_us = 0;
+        for (auto &query: parse_query(query_file)) {
+            if (normalize_query(query).empty()) {
+                continue;
+            }
+            double best = 1e30;
+            const char *category = "invalid";
+            for (int round = 0; round < BENCH_ROUNDS; round++) {
+                const auto begin = chrono::steady_clock::now();
+                string error;
+                const unique_ptr<QueryNode> tree = QueryParser(query).parse(error);
+                vector<string_view> titles;
+                if (tree != nullptr) {
+                    evaluate(index, compile_query(index, *tree)).for_each([&](const int doc) {
+                        titles.emplace_back(index.title(doc));
+                    });
+                    category = query_category(*tree);
+                }
+                const chrono::duration<double, micro> took = chrono::steady_clock::now() - begin;
+                best = std::min(best, took.count());
+                if (round == 0) {
+                    if (titles.empty()) {
+                        lines.emplace_back("Not Found!");
+                    }
+                    lines.insert(lines.end(), titles.begin(), titles.end());
+                }
+            }
+            latencies[category].emplace_back(best);
+            total_us += best;
+        }
+
+        const vector<string> expected = parse_query(expected_file);
+        size_t mismatched = 0;
+        long first_mismatch = -1;
+        for (size_t i = 0; i < std::max(lines.size(), expected.size()); i++) {
+            if (i >= lines.size() || i >= expected.size() || lines[i] != expected[i]) {
+                mismatched++;
+                first_mismatch = first_mismatch < 0 ? (long) i + 1 : first_mismatch;
+            }
+        }
+        const bool correct = mismatched == 0 && !expected.empty();
+        all_correct = all_correct && correct;
+
+        cout << (set == 0 ? "\n" : ",\n") << "    {\n";
+        cout << "      \"data_dir\": " << json_string(data_dir) << ",\n";
+        cout << "      \"query_file\": " << json_string(query_file) << ",\n";
+        cout << "      \"essays\": " << index.document_count() << ",\n";
+        cout << "      \"build_ms\": " << build.count() << ",\n";
+        cout << "      \"index_bytes\": " << index.image_bytes() << ",\n";
+        cout << "      \"terms\": " << index.term_count() << ",\n";
+        cout << "      \"postings\": " << index.posting_count() << ",\n";
+        cout << "      \"bytes_per_term\": " << (double) index.image_bytes() / std::max(1, index.term_count()) << ",\n";
+        cout << "      \"total_query_ms\": " << total_us / 1000 << ",\n";
+        cout << "      \"latency_us\": {";
+        bool first = true;
+        for (auto &category: latencies) {
+            vector<double> &times = category.second;
+            std::sort(times.begin(), times.end());
+            // nearest-rank percentile
+            auto percentile = [&](const double p) {
+                return times[std::min(times.size() - 1, (size_t) std::max(1.0, ceil(p * times.size())) - 1)];
+            };
+            cout << (first ? "\n" : ",\n") << "        " << json_string(category.first) << ": {\"count\": "
+                 << times.size() << ", \"p50\": " << percentile(0.5) << ", \"p99\": " << percentile(0.99)
+                 << ", \"max\": " << times.back() << "}";
+            first = false;
+        }
+        cout << "\n      },\n";
+        cout << "      \"expected_file\": " << json_string(expected_file) << ",\n";
+        cout << "      \"correct\": " << (correct ? "true" : "false") << ",\n";
+        cout << "      \"mismatched_lines\": " << mismatched << ",\n";
+        cout << "      \"first_mismatch_line\": " << first_mismatch << "\n";
+        cout << "    }";
+    }
+    cout << "\n  ],\n  \"peak_rss_kb\": " << peak_rss_kb() << ",\n";
+    cout << "  \"correct\": " << (all_correct ? "true" : "false") << "\n}" << endl;
+    return all_correct ? 0 : 1;
+}
+
+void usage(const char *program) {
+    cerr << "Usage: " << program << " <data_dir> <query_file> <output_file> [options]" << endl;
+    cerr << "       " << program << " index build <data_dir> <index_file> [options]" << endl;
+    cerr << "       " << program << " index query <index_file> <query_file> <output_file> [options]" << endl;
+    cerr << "       " << program << " index verify <index_file>" << endl;
+    cerr << "       " << program << " watch <data_dir>    (queries on stdin, answers on stdout)" << endl;
+    cerr << "       " << program << " serve <index_file|data_dir> <socket_path> [options]" << endl;
+    cerr << "       " << program << " serve <data_dir> <socket_path> --shards N" << endl;
+    cerr << "       " << program << " coordinate <socket_path> <shard_socket>..." << endl;
+    cerr << "       " << program << " client <socket_path> [query_file]" << endl;
+    cerr << "       " << program << " bench {<data_dir> <query_file> <expected_output>}... [--threads N]" << endl;
+    cerr << "       " << program << " bench-tokenizer <data_dir>" << endl;
+    cerr << "       " << program << " bench-setops <data_dir> <query_file> [options]" << endl;
+    cerr << "Options:" << endl;
+    cerr << "  --threads N        index and answer queries with N worker threads" << endl;
+    cerr << "  --mem-report       print dictionary and posting sizes to stderr" << endl;
+    cerr << "  --plan-cache N     keep up to N compiled queries for repeated query lines" << endl;
+    cerr << "  --cache-results    cache each query's result docs along with its plan" << endl;
+    cerr << "  --cache-stats      print query cache counters to stderr" << endl;
+    cerr << "  --echo             also print every result line to stdout" << endl;
+    cerr << "  --incremental      build through delta segments and background merges" << endl;
+    cerr << "  --shard K/N        index build / serve: only the K-th of N doc ranges" << endl;
+    cerr << "  --mem-budget SIZE  build in runs of about SIZE (such as 512M) merged through temporary files" << endl;
+    cerr << "  --shards N         serve: one process per doc range plus a coordinator" << endl;
+    cerr << "  --rank bm25        order each answer by BM25 relevance, best first" << endl;
+    cerr << "  --verify           serve / index query: check the index file's checksum before answering" << endl;
+    cerr << "  --top K            keep the K best docs per query when ranking (default 10)" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    // INPUT :
+    // 1. data directory in data folder
+    // 2. number of txt files
+    // 3. output route
+    vector<string> args;
+    bool mem_report = false;
+    int threads = 1;
+    size_t plan_cache = 0;
+    bool cache_results = false;
+    bool cache_stats = false;
+    bool echo = false;
+    bool incremental = false;
+    bool rank = false;
+    size_t top = 10;
+    bool top_given = false;
+    bool verify = false;
+    int shard = -1;
+    int shard_count = 1;
+    size_t mem_budget = 0;
+    for (int i = 1; i < argc; i++) {
+        const string option = argv[i];
+        if (option == "--mem-report") {
+            mem_report = true;
+        } else if (option == "--threads" && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (option == "--plan-cache" && i + 1 < argc) {
+            plan_cache = atoi(argv[++i]);
+        } else if (option == "--cache-results") {
+            cache_results = true;
+        } else if (option == "--cache-stats") {
+            cache_stats = true;
+        } else if (option == "--echo") {
+            echo = true;
+        } else if (option == "--incremental") {
+            incremental = true;
+        } else if (option == "--verify") {
+            verify = true;
+        } else if (option == "--rank" && i + 1 < argc) {
+            if (string(argv[++i]) != "bm25") {
+                cerr << "Error: unknown ranking " << argv[i] << ", only bm25 is supported" << endl;
+                return 1;
+            }
+            rank = true;
+        } else if (option == "--shards" && i + 1 < argc) {
+            shard_count = std::max(1, atoi(argv[++i]));
+        } else if (option == "--shard" && i + 1 < argc) {
+            // k/N: only the k-th of N doc ranges
+            if (sscanf(argv[++i], "%d/%d", &shard, &shard_count) != 2 || shard < 0 || shard >= shard_count) {
+                cerr << "Error: --shard wants k/N with 0 <= k < N" << endl;
+                return 1;
+            }
+        } else if (option == "--mem-budget" && i + 1 < argc) {
+            // bytes, or with a K, M or G suffix
+            double amount = 0;
+            char unit = 0;
+            const int read = sscanf(argv[++i], "%lf%c", &amount, &unit);
+            const int shift = unit == 'K' || unit == 'k' ? 10 : unit == 'M' || unit == 'm' ? 20 : unit == 'G' || unit == 'g' ? 30 : 0;
+            mem_budget = (size_t) (amount * (double) (1ull << shift));
+            if (read < 1 || (read == 2 && shift == 0) || mem_budget < (1u << 20)) {
+                cerr << "Error: --mem-budget wants a size of at least 1M, such as 512M" << endl;
+                return 1;
+            }
+        } else if (option == "--top" && i + 1 < argc) {
+            top = std::max(1, atoi(argv[++i]));
+            top_given = true;
+        } else {
+            args.emplace_back(option);
+        }
+    }
+
+    if (top_given && !rank) {
+        cerr << "Error: --top only applies with --rank bm25" << endl;
+        return 1;
+    }
+
+    if (args.size() >= 3 && args[0] == "coordinate") {
+        return coordinate_queries(args[1], vector<string>(args.begin() + 2, args.end()), 1);
+    }
+    if (args.size() >= 3 && args[0] == "serve" && shard_count > 1 && shard < 0) {
+        return serve_sharded(args[1] + "/", args[2], shard_count, threads);
+    }
+    if (args.size() >= 2 && args[0] == "client") {
+        return query_client(args[1], args.size() >= 3 ? args[2] : "");
+    }
+    if (args.size() >= 2 && args[0] == "watch") {
+        return watch_essays(args[1] + "/");
+    }
+    if (args.size() >= 4 && args[0] == "bench" && args.size() % 3 == 1) {
+        return bench_suite(vector<string>(args.begin() + 1, args.end()), threads);
+    }
+    if (args.size() >= 2 && args[0] == "bench-tokenizer") {
+        return bench_tokenizer(args[1] + "/");
+    }
+    if (args.size() >= 3 && args[0] == "bench-setops") {
+        return bench_setops(args[1] + "/", args[2], threads);
+    }
+
+    unique_ptr<QueryCache> cache;
+    if (plan_cache > 0) {
+        cache = make_unique<QueryCache>(plan_cache, cache_results);
+    }
+
+    InvertedIndex index;
+    if (args.size() >= 3 && args[0] == "serve") {
+        // an index file is loaded, a data directory is indexed
+        string error;
+        if (!index.load(args[1], error)) {
+            vector<string> essays = list_essays(args[1] + "/");
+            if (shard >= 0) {
+                essays = shard_range(essays, shard, shard_count);
+            }
+            if (essays.empty()) {
+                cerr << "Error loading index: " << error << endl;
+                return 1;
+            }
+            parse_essays(essays, index, threads);
+            index.freeze();
+        } else if (verify && !index.verify()) {
+            cerr << "Error: " << args[1] << " fails its checksum" << endl;
+            return 1;
+        }
+        const int status = serve_queries(index, args[2], cache.get());
+        if (cache != nullptr && cache_stats) {
+            cache->report(cerr);
+        }
+        return status;
+    }
+    if (args.size() >= 4 && args[0] == "index" && args[1] == "build") {
+        vector<string> essays = list_essays(args[2] + "/");
+        if (shard >= 0) {
+            essays = shard_range(essays, shard, shard_count);
+        }
+        if (mem_budget > 0) {
+            string error;
+            if (!build_external(essays, args[3], mem_budget, error) || (mem_report && !index.load(args[3], error))) {
+                cerr << "Error building index: " << error << endl;
+                return 1;
+            }
+        } else {
+            parse_essays(essays, index, threads);
+            index.freeze();
+        }
+        if (mem_report) {
+            index.memory_report(cerr);
+        }
+        if (mem_budget == 0 && !index.save(args[3])) {
+            cerr << "Error writing index " << args[3] << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (args.size() >= 3 && args[0] == "index" && args[1] == "verify") {
+        string error;
+        if (!index.load(args[2], error)) {
+            cerr << "Error loading index: " << error << endl;
+            return 1;
+        }
+        if (!index.verify()) {
+            cerr << "Error: " << args[2] << " fails its checksum" << endl;
+            return 1;
+        }
+        cerr << args[2] << ": " << index.document_count() << " essays, " << index.term_count() << " terms, checksum ok" << endl;
+        return 0;
+    }
+    if (args.size() >= 5 && args[0] == "index" && args[1] == "query") {
+        string error;
+        if (!index.load(args[2], error)) {
+            cerr << "Error loading index: " << error << endl;
+            return 1;
+        }
+        if (verify && !index.verify()) {
+            cerr << "Error: " << args[2] << " fails its checksum" << endl;
+            return 1;
+        }
+        if (mem_report) {
+            index.memory_report(cerr);
+        }
+        vector<string> queries = parse_query(args[3]);
+        ResultWriter writer(args[4], echo);
+        if (!writer.is_open()) {
+            cerr << "Error opening output " << args[4] << endl;
+            return 1;
+        }
+        if (rank) {
+            start_ranked_query(index, queries, writer, cache.get(), top);
+        } else {
+            start_query(index, queries, writer, cache.get(), threads);
+        }
+        if (!writer.flush()) {
+            cerr << "Error writing output " << args[4] << endl;
+            return 1;
+        }
+        if (cache != nullptr && cache_stats) {
+            cache->report(cerr);
+        }
+        return 0;
+    }
+    if (args.size() < 3 || args[0] == "index") {
+        usage(argv[0]);
+        return 1;
+    }
+
+    string data_dir = args[0] + "/";
+    string query = args[1];
+    string output = args[2];
+
+
+    // Read File & Parser Example
+    vector<string> data_set = list_essays(data_dir);
+
+    vector<string> queries = parse_query(query);
+    if (incremental) {
+        LiveIndex live;
+        for (auto &essay: data_set) {
+            live.add(essay);
+        }
+        live.flush();
+        live.wait_merges();
+        ResultWriter writer(output, echo);
+        if (!writer.is_open()) {
+            cerr << "Error opening output " << output << endl;
+            return 1;
+        }
+        start_live_query(*live.snapshot(), queries, writer);
+        if (!writer.flush()) {
+            cerr << "Error writing output " << output << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (mem_budget > 0) {
+        // the index is built into a scratch file and mapped back for the queries
+        const string scratch = output + ".index";
+        string error;
+        const bool built = build_external(data_set, scratch, mem_budget, error) && index.load(scratch, error);
+        remove(scratch.c_str());
+        if (!built) {
+            cerr << "Error building index: " << error << endl;
+            return 1;
+        }
+    } else {
+        parse_essays(data_set, index, threads);
+        index.freeze();
+    }
+    if (mem_report) {
+        index.memory_report(cerr);
+    }
+    ResultWriter writer(output, echo);
+    if (!writer.is_open()) {
+        cerr << "Error opening output " << output << endl;
+        return 1;
+    }
+    if (rank) {
+        start_ranked_query(index, queries, writer, cache.get(), top);
+    } else {
+        start_query(index, queries, writer, cache.get(), threads);
+    }
+    if (!writer.flush()) {
+        cerr << "Error writing output " << output << endl;
+        return 1;
+    }
+    if (cache != nullptr && cache_stats) {
+        cache->report(cerr);
+    }
+}
 
 // 1. UPPERCASE CHARACTER & LOWERCASE CHARACTER ARE SEEN AS SAME.
 // 2. FOR SPECIAL CHARACTER OR DIGITS IN CONTENT OR TITLE -> PLEASE JUST IGNORE, YOU WONT NEED TO CONSIDER IT.